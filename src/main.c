@@ -2,17 +2,32 @@
 #include <getopt.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "wfc.h"
+#include "server.h"
+#include "output.h"
+
+/* How often a headless solve with -k records its progress */
+#define CHECKPOINT_SECONDS 5
+#define CHECKPOINT_CHECK_STEPS 1024
 
 static int seed = -1;
 static int width = 800;
 static int height = 800;
 static int rows = 10;
 static int cols = 10;
-static int depth = 4;
+static int layers = 1;
+static int depth = WFC_DEPTH_FULL;
 static char *tile_set = "";
 static char *src_image = "";
+static char *listen_address = NULL;
+static int workers = 0;
+static char *output = NULL;
+static char *checkpoint = NULL;
+static WfcLayout layout = WFC_LAYOUT_ROWS;
 
 void print_usage() {
     printf("Usage: main [options]\n");
@@ -21,16 +36,22 @@ void print_usage() {
     printf("  -h <window height>\n");
     printf("  -r <tile rows>\n");
     printf("  -c <tile columns>\n");
-    printf("  -d <max recursive depth>\n");
+    printf("  -z <tile layers> (more than one needs -o with a tile index file)\n");
+    printf("  -d <max recursive depth, full or auto>\n");
     printf("  -t <tile set>\n");
     printf("  -i <source image>\n");
+    printf("  -l <socket path, or - for stdin> (serve generation requests)\n");
+    printf("  -j <worker threads>\n");
+    printf("  -o <output file> (solve without a window; .png or tile indices)\n");
+    printf("  -b (store cells in 16x16 blocks)\n");
+    printf("  -k <checkpoint file> (with -o; resume from it if it exists)\n");
 }
 
 void parse_args(int argc, char **argv) {
     opterr = 0;
 
     int c;
-    while ((c = getopt(argc, argv, "s:w:h:r:c:d:t:i:")) != -1) {
+    while ((c = getopt(argc, argv, "s:w:h:r:c:z:d:t:i:l:j:o:bk:")) != -1) {
         switch (c) {
             case 's':
                 seed = atoi(optarg);
@@ -47,8 +68,14 @@ void parse_args(int argc, char **argv) {
             case 'c':
                 cols = atoi(optarg);
                 break;
+            case 'z':
+                layers = atoi(optarg);
+                break;
             case 'd':
-                depth = atoi(optarg);
+                if (!wfc_parse_depth(optarg, &depth)) {
+                    fprintf(stderr, "Invalid depth %s; use full, auto or a positive number\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
                 break;
             case 't':
                 tile_set = optarg;
@@ -56,6 +83,21 @@ void parse_args(int argc, char **argv) {
             case 'i':
                 src_image = optarg;
                 break;
+            case 'l':
+                listen_address = optarg;
+                break;
+            case 'j':
+                workers = atoi(optarg);
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'b':
+                layout = WFC_LAYOUT_BLOCKED;
+                break;
+            case 'k':
+                checkpoint = optarg;
+                break;
 
             case '?':
                 exit(EXIT_FAILURE);
@@ -65,10 +107,95 @@ void parse_args(int argc, char **argv) {
     }
 }
 
+/* Picks up from the checkpoint if there is one, then solves while recording progress in it */
+static bool solve_checkpointed(Wfc *wfc, const char *path) {
+    if (access(path, F_OK) == 0 && !wfc_resume(wfc, path)) {
+        fprintf(stderr, "Failed to resume from %s\n", path);
+        return false;
+    }
+
+    time_t last = time(NULL);
+    for (long i = 1; ; i++) {
+        WfcStatus status = wfc_step(wfc);
+        if (status == WFC_DONE) {
+            return true;
+        } else if (status == WFC_FAILED) {
+            return false;
+        }
+
+        if (i % CHECKPOINT_CHECK_STEPS == 0 && time(NULL) - last >= CHECKPOINT_SECONDS) {
+            if (!wfc_checkpoint(wfc, path)) {
+                fprintf(stderr, "Failed to write checkpoint %s\n", path);
+            }
+            last = time(NULL);
+        }
+    }
+}
+
 int main(int argc, char **argv) {
     parse_args(argc, argv);
 
-    wfc_init(seed, rows, cols, tile_set, depth);
+    if (listen_address != NULL) {
+        ServerConfig config = {
+            .address = listen_address,
+            .tile_set = tile_set,
+            .workers = workers,
+            .rows = rows,
+            .cols = cols,
+            .seed = seed,
+            .depth = depth,
+            .layout = layout
+        };
+
+        return server_run(config) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    TileSet *tiles = wfc_tileset_load(tile_set);
+    if (tiles == NULL) {
+        fprintf(stderr, "Failed to load tile set %s\n", tile_set);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Volumes and voxel tile sets have nothing to show in a window */
+    bool voxels = layers > 1 || wfc_tile_width(tiles) == 0;
+    size_t len = output != NULL ? strlen(output) : 0;
+    bool png = len > 4 && strcmp(output + len - 4, ".png") == 0;
+    if (voxels && (output == NULL || png)) {
+        fprintf(stderr, "Tile set %s builds volumes; write them with -o to a tile index file\n", tile_set);
+        wfc_tileset_free(tiles);
+        exit(EXIT_FAILURE);
+    }
+
+    Wfc *wfc = wfc_create_3d(tiles, seed, rows, cols, layers, depth);
+    if (wfc == NULL) {
+        fprintf(stderr, "Cannot create a %d x %d x %d grid\n", rows, cols, layers);
+        wfc_tileset_free(tiles);
+        exit(EXIT_FAILURE);
+    }
+    /* Volumes are always blocked */
+    if (layers == 1) {
+        wfc_set_layout(wfc, layout);
+    }
+
+    if (output != NULL) {
+        bool ok = checkpoint != NULL ? solve_checkpointed(wfc, checkpoint) : wfc_solve(wfc, -1);
+        if (wfc_depth(wfc) == WFC_DEPTH_FULL) {
+            fprintf(stderr, "propagation depth: full\n");
+        } else {
+            fprintf(stderr, "propagation depth: %d\n", wfc_depth(wfc));
+        }
+        ok = ok && (png ? output_write_png(wfc, output) : output_write_tiles(wfc, output));
+
+        /* A finished map needs no checkpoint */
+        if (ok && checkpoint != NULL) {
+            remove(checkpoint);
+        }
+
+        wfc_free(wfc);
+        wfc_tileset_free(tiles);
+
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
 
     SetConfigFlags(FLAG_VSYNC_HINT | FLAG_WINDOW_HIGHDPI);
 
@@ -76,17 +203,25 @@ int main(int argc, char **argv) {
 
     SetTargetFPS(30);
 
-    Image blank = GenImageColor(rows * wfc_tile_width(), cols * wfc_tile_height(), BLACK);
+    Image blank = GenImageColor(cols * wfc_tile_width(tiles), rows * wfc_tile_height(tiles), BLACK);
     ImageFormat(&blank, PIXELFORMAT_UNCOMPRESSED_R8G8B8);
     Texture texture = LoadTextureFromImage(blank);
     UnloadImage(blank);
 
     while (!WindowShouldClose()) {
-        wfc_step();
-        wfc_draw(texture);
+        WfcStatus status = wfc_step(wfc);
+        if (status == WFC_CONFLICT) {
+            printf("CONFLICT\n");
+        } else if (status == WFC_DONE) {
+            wfc_restart(wfc);
+        }
+        wfc_draw(wfc, texture);
     }
 
     CloseWindow();
 
+    wfc_free(wfc);
+    wfc_tileset_free(tiles);
+
     return 0;
 }
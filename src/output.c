@@ -0,0 +1,184 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <zlib.h>
+
+#include "output.h"
+
+#define OUTPUT_VERSION 1
+#define OUTPUT_VERSION_LAYERS 2
+#define IDAT_SIZE (64 * 1024)
+
+static void put_u16(uint8_t *dest, uint16_t value) {
+    dest[0] = value & 0xff;
+    dest[1] = value >> 8;
+}
+
+static void put_u32(uint8_t *dest, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        dest[i] = (value >> (8 * i)) & 0xff;
+    }
+}
+
+static void put_u32_be(uint8_t *dest, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        dest[i] = (value >> (8 * (3 - i))) & 0xff;
+    }
+}
+
+bool output_write_tiles(Wfc *wfc, const char *path) {
+    int rows = wfc_rows(wfc);
+    int cols = wfc_cols(wfc);
+    int layers = wfc_layers(wfc);
+    int num_tiles = wfc_tileset_num_tiles(wfc_tileset(wfc));
+    int width = num_tiles < 0xff ? 1 : 2;
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        return false;
+    }
+
+    /* Flat maps keep the version 1 header so existing readers still work */
+    uint8_t header[24] = {'W', 'F', 'C', 'T', layers > 1 ? OUTPUT_VERSION_LAYERS : OUTPUT_VERSION, width, 0, 0};
+    put_u32(header + 8, rows);
+    put_u32(header + 12, cols);
+    put_u32(header + 16, num_tiles);
+    put_u32(header + 20, layers);
+    size_t header_size = layers > 1 ? 24 : 20;
+    bool ok = fwrite(header, 1, header_size, file) == header_size;
+
+    uint8_t *row = malloc((size_t) cols * width);
+    for (int z = 0; ok && z < layers; z++) {
+        for (int i = 0; ok && i < rows; i++) {
+            for (int j = 0; j < cols; j++) {
+                int tile = wfc_voxel_at(wfc, i, j, z);
+                if (width == 1) {
+                    row[j] = tile < 0 ? 0xff : tile;
+                } else {
+                    put_u16(row + 2 * j, tile < 0 ? 0xffff : tile);
+                }
+            }
+            ok = fwrite(row, width, cols, file) == cols;
+        }
+    }
+    free(row);
+
+    return fclose(file) == 0 && ok;
+}
+
+static bool png_chunk(FILE *file, const char *type, const uint8_t *data, uint32_t size) {
+    uint8_t head[8];
+    uint8_t tail[4];
+
+    put_u32_be(head, size);
+    memcpy(head + 4, type, 4);
+
+    uLong crc = crc32(0, head + 4, 4);
+    if (size > 0) {
+        crc = crc32(crc, data, size);
+    }
+    put_u32_be(tail, crc);
+
+    return fwrite(head, 1, 8, file) == 8 && fwrite(data, 1, size, file) == size && fwrite(tail, 1, 4, file) == 4;
+}
+
+/* Feeds `size` bytes to the compressor and writes out every full IDAT chunk */
+static bool png_deflate(FILE *file, z_stream *stream, uint8_t *out, const uint8_t *data, size_t size, int flush) {
+    stream->next_in = (Bytef *) data;
+    stream->avail_in = size;
+
+    int ret;
+    do {
+        ret = deflate(stream, flush);
+        if (ret == Z_STREAM_ERROR) {
+            return false;
+        }
+
+        bool full = stream->avail_out == 0;
+        bool done = flush == Z_FINISH && ret == Z_STREAM_END;
+        if ((full || done) && stream->avail_out < IDAT_SIZE) {
+            if (!png_chunk(file, "IDAT", out, IDAT_SIZE - stream->avail_out)) {
+                return false;
+            }
+            stream->next_out = out;
+            stream->avail_out = IDAT_SIZE;
+        }
+    } while (stream->avail_in > 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+
+    return true;
+}
+
+bool output_write_png(Wfc *wfc, const char *path) {
+    TileSet *tile_set = wfc_tileset(wfc);
+    int rows = wfc_rows(wfc);
+    int cols = wfc_cols(wfc);
+    int tile_width = wfc_tile_width(tile_set);
+    int tile_height = wfc_tile_height(tile_set);
+    size_t tile_pitch = (size_t) tile_width * 3;
+    uint64_t width = (uint64_t) cols * tile_width;
+    uint64_t height = (uint64_t) rows * tile_height;
+
+    /* Voxel tile sets have no pictures, and volumes have no single image */
+    if (tile_width == 0 || wfc_layers(wfc) > 1 || width > INT32_MAX || height > INT32_MAX) {
+        return false;
+    }
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        return false;
+    }
+
+    static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    uint8_t ihdr[13] = {0};
+    put_u32_be(ihdr, width);
+    put_u32_be(ihdr + 4, height);
+    ihdr[8] = 8;  /* bits per channel */
+    ihdr[9] = 2;  /* truecolor */
+
+    bool ok = fwrite(signature, 1, sizeof(signature), file) == sizeof(signature);
+    ok = ok && png_chunk(file, "IHDR", ihdr, sizeof(ihdr));
+
+    z_stream stream = {0};
+    uint8_t *out = malloc(IDAT_SIZE);
+    uint8_t *scanline = malloc(1 + width * 3);
+    const unsigned char **row_tiles = malloc(cols * sizeof(unsigned char *));
+
+    ok = ok && deflateInit(&stream, Z_DEFAULT_COMPRESSION) == Z_OK;
+    stream.next_out = out;
+    stream.avail_out = IDAT_SIZE;
+
+    /* Only one scanline of the image exists at a time */
+    scanline[0] = 0;
+    for (int i = 0; ok && i < rows; i++) {
+        for (int j = 0; j < cols; j++) {
+            int tile = wfc_tile_at(wfc, i, j);
+            row_tiles[j] = tile < 0 ? NULL : wfc_tile_pixels(tile_set, tile);
+        }
+
+        for (int y = 0; ok && y < tile_height; y++) {
+            uint8_t *dest = scanline + 1;
+            for (int j = 0; j < cols; j++, dest += tile_pitch) {
+                if (row_tiles[j] != NULL) {
+                    memcpy(dest, row_tiles[j] + y * tile_pitch, tile_pitch);
+                } else {
+                    memset(dest, 0, tile_pitch);
+                }
+            }
+
+            ok = png_deflate(file, &stream, out, scanline, 1 + width * 3, Z_NO_FLUSH);
+        }
+    }
+
+    ok = ok && png_deflate(file, &stream, out, NULL, 0, Z_FINISH);
+    ok = ok && png_chunk(file, "IEND", NULL, 0);
+
+    deflateEnd(&stream);
+    free(row_tiles);
+    free(scanline);
+    free(out);
+
+    return fclose(file) == 0 && ok;
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include <stdbool.h>
+
+#include "wfc.h"
+
+/*
+ * Tile index file, all integers little endian:
+ *
+ *   "WFCT" | u8 version | u8 bytes per index | u16 reserved
+ *   u32 rows | u32 cols | u32 tiles
+ *   rows * cols indices, row-major
+ *
+ * Indices are u8 when the tile set has fewer than 255 tiles and u16
+ * otherwise. The all-ones value marks a cell that was never collapsed.
+ *
+ * Volumes are written as version 2, which adds u32 layers after the tile
+ * count and stores the layers one after another, bottom first.
+ */
+bool output_write_tiles(Wfc *wfc, const char *path);
+
+/* Composites the map into an RGB PNG one scanline at a time; flat maps of picture tiles only */
+bool output_write_png(Wfc *wfc, const char *path);
@@ -0,0 +1,562 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <raylib.h>
+
+#include "server.h"
+#include "wfc.h"
+
+/* Longest request line, room for tens of thousands of constraints */
+#define MAX_LINE (1 << 20)
+#define MAX_CONSTRAINT_TILES 256
+#define STEPS_PER_CELL 64
+/* Largest map a request may ask for, well inside what the solver can index */
+#define MAX_JOB_CELLS (1 << 24)
+/* Most solver copies a request may race */
+#define MAX_PORTFOLIO 16
+
+/*
+ * Line protocol, one request per line:
+ *
+ *   id=<name> tiles=<dir> rows=<n> cols=<n> seed=<n> depth=<n|full|auto>
+ *   steps=<n> portfolio=<n> layout=<rows|blocked>
+ *
+ * Every key is optional and falls back to the defaults the server was started
+ * with. A portfolio of more than MAX_PORTFOLIO copies is rejected. Any number
+ * of constraints may follow, with tile lists separated by ':'
+ *
+ *   fix=<r>,<c>,<tile>
+ *   rect=<r>,<c>,<rows>,<cols>,<tiles>
+ *   mask=<png>,<tiles>
+ *
+ * Replies are written back on the same stream, one block per request:
+ *
+ *   ok <id> <rows> <cols> depth=<n|full> portfolio=<n>
+ *   <rows lines of space separated tile indices>
+ *
+ * where depth is the propagation depth used, the one picked when it was auto,
+ * and portfolio the number of copies raced, or a single "error <id> <reason>"
+ * line. A line longer than MAX_LINE, or holding a NUL byte, is answered with
+ * "error <id> request" and not run.
+ */
+
+typedef struct {
+    FILE *out;
+    bool owns_out;
+    pthread_mutex_t lock;
+    int refs;
+} Connection;
+
+typedef struct Job {
+    struct Job *next;
+    Connection *conn;
+    char id[64];
+    char tile_set[256];
+    int rows;
+    int cols;
+    int seed;
+    int depth;
+    long max_steps;
+    int portfolio;
+    WfcLayout layout;
+    char *constraints;
+} Job;
+
+typedef struct CacheEntry {
+    struct CacheEntry *next;
+    char *name;
+    TileSet *tile_set;
+} CacheEntry;
+
+static struct {
+    Job *head;
+    Job *tail;
+    bool closing;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+} queue = {.lock = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER};
+
+static CacheEntry *cache = NULL;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static ServerConfig config;
+
+/* Call with cache_lock held */
+static CacheEntry *cache_find(const char *name) {
+    CacheEntry *entry = cache;
+    while (entry != NULL && strcmp(entry->name, name) != 0) {
+        entry = entry->next;
+    }
+
+    return entry;
+}
+
+/*
+ * Tile sets are decoded outside the lock so a cold set never holds up lookups
+ * of warm ones. Two workers may decode the same set at once; the first to
+ * finish is kept and the other copy is dropped.
+ */
+static TileSet *cache_get(const char *name) {
+    pthread_mutex_lock(&cache_lock);
+    CacheEntry *entry = cache_find(name);
+    pthread_mutex_unlock(&cache_lock);
+
+    if (entry != NULL) {
+        return entry->tile_set;
+    }
+
+    TileSet *tile_set = wfc_tileset_load(name);
+    if (tile_set == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    entry = cache_find(name);
+    if (entry == NULL) {
+        entry = malloc(sizeof(CacheEntry));
+        *entry = (CacheEntry) {.next = cache, .name = strdup(name), .tile_set = tile_set};
+        cache = entry;
+        tile_set = NULL;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    if (tile_set != NULL) {
+        wfc_tileset_free(tile_set);
+    }
+
+    return entry->tile_set;
+}
+
+static Connection *connection_create(FILE *out, bool owns_out) {
+    Connection *conn = malloc(sizeof(Connection));
+    *conn = (Connection) {.out = out, .owns_out = owns_out, .refs = 1};
+    pthread_mutex_init(&conn->lock, NULL);
+
+    return conn;
+}
+
+static void connection_retain(Connection *conn) {
+    pthread_mutex_lock(&conn->lock);
+    conn->refs++;
+    pthread_mutex_unlock(&conn->lock);
+}
+
+static void connection_release(Connection *conn) {
+    pthread_mutex_lock(&conn->lock);
+    int refs = --conn->refs;
+    pthread_mutex_unlock(&conn->lock);
+
+    if (refs == 0) {
+        if (conn->owns_out) {
+            fclose(conn->out);
+        } else {
+            fflush(conn->out);
+        }
+        pthread_mutex_destroy(&conn->lock);
+        free(conn);
+    }
+}
+
+static void queue_push(Job *job) {
+    pthread_mutex_lock(&queue.lock);
+
+    if (queue.tail != NULL) {
+        queue.tail->next = job;
+    } else {
+        queue.head = job;
+    }
+    queue.tail = job;
+
+    pthread_cond_signal(&queue.ready);
+    pthread_mutex_unlock(&queue.lock);
+}
+
+static Job *queue_pop() {
+    pthread_mutex_lock(&queue.lock);
+
+    while (queue.head == NULL && !queue.closing) {
+        pthread_cond_wait(&queue.ready, &queue.lock);
+    }
+
+    Job *job = queue.head;
+    if (job != NULL) {
+        queue.head = job->next;
+        if (queue.head == NULL) {
+            queue.tail = NULL;
+        }
+    }
+
+    pthread_mutex_unlock(&queue.lock);
+
+    return job;
+}
+
+static void queue_close() {
+    pthread_mutex_lock(&queue.lock);
+    queue.closing = true;
+    pthread_cond_broadcast(&queue.ready);
+    pthread_mutex_unlock(&queue.lock);
+}
+
+static void reply_error(Connection *conn, const char *id, const char *reason) {
+    pthread_mutex_lock(&conn->lock);
+    fprintf(conn->out, "error %s %s\n", id, reason);
+    fflush(conn->out);
+    pthread_mutex_unlock(&conn->lock);
+}
+
+/* Reads a ':' separated tile list; -1 if an entry is not a number or there are too many */
+static int parse_tiles(const char *list, int *tiles) {
+    int num_tiles = 0;
+
+    while (true) {
+        char *end;
+        errno = 0;
+        long tile = strtol(list, &end, 10);
+        if (end == list || errno != 0 || tile < INT_MIN || tile > INT_MAX || num_tiles == MAX_CONSTRAINT_TILES) {
+            return -1;
+        }
+        tiles[num_tiles++] = (int) tile;
+
+        if (*end == '\0') {
+            return num_tiles;
+        } else if (*end != ':') {
+            return -1;
+        }
+        list = end + 1;
+    }
+}
+
+static bool job_constrain(Wfc *wfc, char *key, char *value) {
+    int tiles[MAX_CONSTRAINT_TILES];
+    int r, c, rows, cols, tile, offset = 0;
+
+    if (strcmp(key, "fix") == 0) {
+        return sscanf(value, "%d,%d,%d", &r, &c, &tile) == 3 && wfc_fix(wfc, r, c, tile);
+    } else if (strcmp(key, "rect") == 0) {
+        if (sscanf(value, "%d,%d,%d,%d,%n", &r, &c, &rows, &cols, &offset) != 4 || offset == 0) {
+            return false;
+        }
+        int num_tiles = parse_tiles(value + offset, tiles);
+        return num_tiles > 0 && wfc_restrict(wfc, r, c, rows, cols, tiles, num_tiles);
+    } else if (strcmp(key, "mask") == 0) {
+        char *list = strrchr(value, ',');
+        if (list == NULL) {
+            return false;
+        }
+        *list++ = '\0';
+
+        int num_tiles = parse_tiles(list, tiles);
+        if (num_tiles < 0) {
+            return false;
+        }
+
+        Image mask = LoadImage(value);
+        if (mask.data == NULL) {
+            return false;
+        }
+        bool ok = wfc_restrict_mask(wfc, mask, tiles, num_tiles);
+        UnloadImage(mask);
+        return ok;
+    }
+
+    return false;
+}
+
+static void job_run(Job *job) {
+    TileSet *tile_set = cache_get(job->tile_set);
+    if (tile_set == NULL) {
+        reply_error(job->conn, job->id, "tileset");
+        return;
+    }
+
+    Wfc *wfc = wfc_create(tile_set, job->seed, job->rows, job->cols, job->depth);
+    if (wfc == NULL) {
+        reply_error(job->conn, job->id, "memory");
+        return;
+    }
+    wfc_set_layout(wfc, job->layout);
+
+    char *save = NULL;
+    for (char *tok = strtok_r(job->constraints, " ", &save); tok != NULL; tok = strtok_r(NULL, " ", &save)) {
+        char *value = strchr(tok, '=');
+        *value++ = '\0';
+
+        if (!job_constrain(wfc, tok, value)) {
+            reply_error(job->conn, job->id, "constraint");
+            wfc_free(wfc);
+            return;
+        }
+    }
+
+    errno = 0;
+    if (!wfc_solve_portfolio(wfc, job->portfolio, job->max_steps)) {
+        reply_error(job->conn, job->id, errno == ENOMEM ? "memory" : "unsolved");
+        wfc_free(wfc);
+        return;
+    }
+
+    /* Stream the result a row at a time so large maps never need a second copy */
+    char *row = malloc(job->cols * 6 + 2);
+
+    char depth[16] = "full";
+    if (wfc_depth(wfc) != WFC_DEPTH_FULL) {
+        snprintf(depth, sizeof(depth), "%d", wfc_depth(wfc));
+    }
+
+    pthread_mutex_lock(&job->conn->lock);
+    fprintf(job->conn->out, "ok %s %d %d depth=%s portfolio=%d\n", job->id, job->rows, job->cols, depth, job->portfolio);
+    for (int i = 0; i < job->rows; i++) {
+        int len = 0;
+        for (int j = 0; j < job->cols; j++) {
+            len += sprintf(row + len, j == 0 ? "%d" : " %d", wfc_tile_at(wfc, i, j));
+        }
+        row[len++] = '\n';
+        fwrite(row, 1, len, job->conn->out);
+    }
+    fflush(job->conn->out);
+    pthread_mutex_unlock(&job->conn->lock);
+
+    free(row);
+    wfc_free(wfc);
+}
+
+static void *worker_main(void *arg) {
+    Job *job;
+    while ((job = queue_pop()) != NULL) {
+        job_run(job);
+        connection_release(job->conn);
+        free(job->constraints);
+        free(job);
+    }
+
+    return NULL;
+}
+
+/* A line that did not fit is still parsed for its id, but never run */
+static Job *job_parse(char *line, bool whole, Connection *conn, int seq) {
+    /* Each constraint keeps the separator after it, so the line's length is enough */
+    size_t constraints_size = strlen(line) + 2;
+    Job *job = calloc(1, sizeof(Job));
+    *job = (Job) {
+        .conn = conn,
+        .rows = config.rows,
+        .cols = config.cols,
+        .seed = config.seed,
+        .depth = config.depth,
+        .max_steps = -1,
+        .portfolio = 1,
+        .layout = config.layout,
+        .constraints = calloc(constraints_size, 1)
+    };
+    snprintf(job->id, sizeof(job->id), "%d", seq);
+    snprintf(job->tile_set, sizeof(job->tile_set), "%s", config.tile_set);
+
+    char *save = NULL;
+    for (char *tok = strtok_r(line, " \t\r\n", &save); tok != NULL; tok = strtok_r(NULL, " \t\r\n", &save)) {
+        char *value = strchr(tok, '=');
+        if (value == NULL) {
+            goto invalid;
+        }
+        *value++ = '\0';
+
+        if (strcmp(tok, "id") == 0) {
+            snprintf(job->id, sizeof(job->id), "%s", value);
+        } else if (strcmp(tok, "tiles") == 0) {
+            snprintf(job->tile_set, sizeof(job->tile_set), "%s", value);
+        } else if (strcmp(tok, "rows") == 0) {
+            job->rows = atoi(value);
+        } else if (strcmp(tok, "cols") == 0) {
+            job->cols = atoi(value);
+        } else if (strcmp(tok, "seed") == 0) {
+            job->seed = atoi(value);
+        } else if (strcmp(tok, "depth") == 0) {
+            if (!wfc_parse_depth(value, &job->depth)) {
+                goto invalid;
+            }
+        } else if (strcmp(tok, "steps") == 0) {
+            job->max_steps = atol(value);
+        } else if (strcmp(tok, "portfolio") == 0) {
+            job->portfolio = atoi(value);
+        } else if (strcmp(tok, "layout") == 0 && strcmp(value, "rows") == 0) {
+            job->layout = WFC_LAYOUT_ROWS;
+        } else if (strcmp(tok, "layout") == 0 && strcmp(value, "blocked") == 0) {
+            job->layout = WFC_LAYOUT_BLOCKED;
+        } else if (strcmp(tok, "fix") == 0 || strcmp(tok, "rect") == 0 || strcmp(tok, "mask") == 0) {
+            /* Applied by the worker once the solver exists */
+            size_t len = strlen(job->constraints);
+            snprintf(job->constraints + len, constraints_size - len, "%s=%s ", tok, value);
+        } else {
+            goto invalid;
+        }
+    }
+
+    if (!whole || job->rows <= 0 || job->cols <= 0 || (int64_t) job->rows * job->cols > MAX_JOB_CELLS) {
+        goto invalid;
+    }
+
+    /* The same request races the same copies on any host, so too many is an error rather than cut down */
+    if (job->portfolio > MAX_PORTFOLIO) {
+        goto invalid;
+    }
+    job->portfolio = job->portfolio > 1 ? job->portfolio : 1;
+
+    if (job->max_steps < 0) {
+        job->max_steps = (long) STEPS_PER_CELL * job->rows * job->cols;
+    }
+
+    return job;
+
+invalid:
+    reply_error(conn, job->id, "request");
+    free(job->constraints);
+    free(job);
+    return NULL;
+}
+
+/*
+ * Reads one line into `line`, growing it up to MAX_LINE, without the newline.
+ * A line that does not fit, or holds a NUL byte, is still read to its end but
+ * with `whole` cleared; what was kept is only good for finding its id. False
+ * at EOF.
+ */
+static bool read_line(FILE *in, char **line, size_t *size, bool *whole) {
+    size_t len = 0;
+    int c;
+    *whole = true;
+
+    while ((c = getc(in)) != EOF && c != '\n') {
+        if (c == '\0') {
+            *whole = false;
+            continue;
+        }
+
+        if (len + 2 > *size) {
+            size_t grown = *size * 2 < MAX_LINE ? *size * 2 : MAX_LINE;
+            char *larger = grown > *size ? realloc(*line, grown) : NULL;
+            if (larger == NULL) {
+                *whole = false;
+                continue;
+            }
+            *line = larger;
+            *size = grown;
+        }
+        (*line)[len++] = c;
+    }
+    (*line)[len] = '\0';
+
+    return c != EOF || len > 0;
+}
+
+/* Reads requests until EOF, handing each one to the worker pool */
+static void connection_serve(FILE *in, Connection *conn) {
+    size_t size = 4096;
+    char *line = malloc(size);
+    bool whole;
+    int seq = 0;
+
+    while (read_line(in, &line, &size, &whole)) {
+        if (line[strspn(line, " \t\r\n")] == '\0' || line[0] == '#') {
+            continue;
+        }
+
+        Job *job = job_parse(line, whole, conn, seq++);
+        if (job != NULL) {
+            connection_retain(conn);
+            queue_push(job);
+        }
+    }
+
+    free(line);
+    connection_release(conn);
+}
+
+static void *client_main(void *arg) {
+    int fd = (int) (intptr_t) arg;
+
+    FILE *in = fdopen(fd, "r");
+    FILE *out = fdopen(dup(fd), "w");
+    connection_serve(in, connection_create(out, true));
+    fclose(in);
+
+    return NULL;
+}
+
+static int listen_unix(const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int server_run(ServerConfig server_config) {
+    config = server_config;
+
+    /* raylib logs to stdout, which may be our reply stream */
+    SetTraceLogLevel(LOG_NONE);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (config.tile_set[0] != '\0' && cache_get(config.tile_set) == NULL) {
+        fprintf(stderr, "Failed to load tile set %s\n", config.tile_set);
+        return -1;
+    }
+
+    int num_workers = config.workers > 0 ? config.workers : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    num_workers = num_workers > 0 ? num_workers : 1;
+    pthread_t *workers = malloc(num_workers * sizeof(pthread_t));
+    for (int i = 0; i < num_workers; i++) {
+        pthread_create(&workers[i], NULL, worker_main, NULL);
+    }
+
+    if (strcmp(config.address, "-") == 0) {
+        connection_serve(stdin, connection_create(stdout, false));
+    } else {
+        int listen_fd = listen_unix(config.address);
+        if (listen_fd < 0) {
+            perror("listen");
+        }
+
+        while (listen_fd >= 0) {
+            int fd = accept(listen_fd, NULL, NULL);
+            if (fd < 0) {
+                continue;
+            }
+
+            pthread_t client;
+            pthread_create(&client, NULL, client_main, (void *) (intptr_t) fd);
+            pthread_detach(client);
+        }
+    }
+
+    queue_close();
+    for (int i = 0; i < num_workers; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+
+    return 0;
+}
@@ -0,0 +1,16 @@
+#pragma once
+#include "wfc.h"
+
+typedef struct {
+    const char *address;
+    const char *tile_set;
+    int workers;
+    int rows;
+    int cols;
+    int seed;
+    int depth;
+    WfcLayout layout;
+} ServerConfig;
+
+/* Serves generation requests on a Unix socket, or stdin/stdout for "-" */
+int server_run(ServerConfig config);
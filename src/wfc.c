@@ -7,19 +7,51 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <raylib.h>
+#include <zlib.h>
 
 #include "wfc.h"
 
-#define MAX_TILES 128
-#define MAX_DEPTH 4
+/*
+ * Steps the depth tuner spends on each setting, scaled by grid size between
+ * these. Conflicts are rare but dominate the cost, so a window is stretched up
+ * to TUNE_MAX_STRETCH times until it has seen a few. All windows together get
+ * one step in TUNE_SHARE of the grid's cells, and one costing TUNE_ABANDON
+ * times the best so far is cut short.
+ */
+#define TUNE_MIN_WINDOW 128
+#define TUNE_MAX_WINDOW 4096
+#define TUNE_MAX_STRETCH 4
+#define TUNE_MIN_CONFLICTS 4
+#define TUNE_SHARE 16
+#define TUNE_ABANDON 2
+#define WORD_BITS 64
+/* Blocked layouts store cells in 16x16 tiles, or 8x8x8 bricks for volumes */
+#define BLOCK_SHIFT 4
+#define BRICK_SHIFT 3
+/* Cells each portfolio instance may visit between two looks at the race */
+#define PORTFOLIO_EPOCH_WORK (1 << 15)
+#define CHECKPOINT_VERSION 2
+/* A checkpoint log is rewritten as a single snapshot once it outgrows this many */
+#define CHECKPOINT_COMPACT_RATIO 4
 
 #define MAX(x, y) (((x) > (y)) ? (x) : (y))
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
 
+/* ABOVE and BELOW step between layers of a volume */
 enum Direction {
-    UP, RIGHT, DOWN, LEFT
+    UP, RIGHT, DOWN, LEFT, ABOVE, BELOW, NUM_DIRECTIONS
+};
+
+static const int opposite[NUM_DIRECTIONS] = {
+    [UP] = DOWN, [RIGHT] = LEFT, [DOWN] = UP, [LEFT] = RIGHT, [ABOVE] = BELOW, [BELOW] = ABOVE
 };
 
 enum Matches {
@@ -31,103 +63,214 @@ enum Matches {
 
 typedef struct Tile {
     Image img;
-    struct Tile *options[4][MAX_TILES];
-    int num_options[4];
     float frequency;
-    int hash_value;
     int id;
 } Tile;
 
-Tile *tiles[MAX_TILES];
-int tile_idx = 0;
-int num_tiles = 0;
+/*
+ * Domains are bitsets of `num_words` words, bit i standing for tile i. The
+ * kernels that work on them are picked once per tile set from the variants
+ * below, sized for 64, 128 or 256 tiles, or any count.
+ */
+typedef struct {
+    /* Keeps the tiles every present neighbor supports, returns how many are left */
+    int (*narrow)(TileSet *tile_set, uint64_t *domain, uint64_t *const adj[NUM_DIRECTIONS]);
+    int (*count)(TileSet *tile_set, const uint64_t *domain);
+    float (*entropy)(TileSet *tile_set, const uint64_t *domain);
+    /* Weighted choice of a tile, v in [0, 1) */
+    int (*pick)(TileSet *tile_set, const uint64_t *domain, float v);
+} DomainKernels;
+
+struct TileSet {
+    Tile **tiles;
+    int num_tiles;
+    int num_words;
+    const DomainKernels *kernels;
+    /*
+     * compat[dir][tile] is the domain allowed next to `tile` towards `dir`.
+     * Picture tiles allow anything above and below, so layers stack freely.
+     */
+    uint64_t *compat;
+    /* Tiles described by the sockets on their faces, without pictures */
+    bool voxels;
+    uint64_t *full;
+    float *weights;
+    Tile *tile_pool;
+    uint8_t *pixels;
+};
 
-uint64_t tile_hash(Tile *tile) {
-    uint64_t hash = 5381;
-    size_t bytes = tile->img.width * tile->img.height;
-    uint8_t *data = (uint8_t *) tile->img.data;
+static inline bool domain_has(const uint64_t *domain, int tile) {
+    return (domain[tile / WORD_BITS] >> (tile % WORD_BITS)) & 1;
+}
 
-    for (int i = 0; i < bytes; i++) {
-        int c = *((uint8_t *) data++);
-        hash = (hash << 5) + hash + c;
-    }
+static inline void domain_set(uint64_t *domain, int tile) {
+    domain[tile / WORD_BITS] |= (uint64_t) 1 << (tile % WORD_BITS);
+}
 
-    return hash;
+static inline void domain_clear(uint64_t *domain, int tile) {
+    domain[tile / WORD_BITS] &= ~((uint64_t) 1 << (tile % WORD_BITS));
 }
 
-static int tile_id = 0;
+static inline int domain_first(const uint64_t *domain, int words) {
+    for (int w = 0; w < words; w++) {
+        if (domain[w]) {
+            return w * WORD_BITS + __builtin_ctzll(domain[w]);
+        }
+    }
 
-Tile *tile_create_from_image(char *file, float weight) {
-    Tile *tile = calloc(1, sizeof(Tile));
+    return -1;
+}
 
-    tile->img = LoadImage(file);
-    ImageFormat(&tile->img, PIXELFORMAT_UNCOMPRESSED_R8G8B8);
-    tile->hash_value = tile_hash(tile);
-    tile->frequency = weight;
-    tile->id = tile_id++;
+/*
+ * Kernel bodies. `words` is a literal in the sized variants, so once these
+ * are inlined every loop over words unrolls away.
+ */
+static inline __attribute__((always_inline)) int domain_count(const uint64_t *domain, int words) {
+    int count = 0;
+    for (int w = 0; w < words; w++) {
+        count += __builtin_popcountll(domain[w]);
+    }
 
-    return tile;
+    return count;
 }
 
-Tile *tile_rotate90(Tile *src) {
-    Tile *dest = calloc(1, sizeof(Tile));
-
-    dest->frequency = src->frequency;
-    dest->id = tile_id++;
+/* An emptied domain is left as it was, so a conflict never loses a collapsed tile */
+static inline __attribute__((always_inline)) int domain_narrow(TileSet *tile_set, uint64_t *domain, uint64_t *const adj[NUM_DIRECTIONS], int words) {
+    uint64_t result[words];
+    for (int w = 0; w < words; w++) {
+        result[w] = domain[w];
+    }
 
-    dest->img = ImageCopy(src->img);
-    ImageRotateCW(&dest->img);
+    for (int d = 0; d < NUM_DIRECTIONS; d++) {
+        if (adj[d] == NULL) {
+            continue;
+        }
 
-    return dest;
-}
+        const uint64_t *compat = tile_set->compat + (size_t) opposite[d] * tile_set->num_tiles * words;
+        uint64_t support[words];
+        for (int w = 0; w < words; w++) {
+            support[w] = 0;
+        }
 
-Tile *tile_rotate180(Tile *src) {
-    Tile *dest = calloc(1, sizeof(Tile));
+        for (int w = 0; w < words; w++) {
+            for (uint64_t bits = adj[d][w]; bits; bits &= bits - 1) {
+                const uint64_t *mask = compat + (size_t) (w * WORD_BITS + __builtin_ctzll(bits)) * words;
+                for (int k = 0; k < words; k++) {
+                    support[k] |= mask[k];
+                }
+            }
+        }
 
-    dest->frequency = src->frequency;
-    dest->id = tile_id++;
+        for (int w = 0; w < words; w++) {
+            result[w] &= support[w];
+        }
+    }
 
-    dest->img = ImageCopy(src->img);
-    ImageRotateCW(&dest->img);
-    ImageRotateCW(&dest->img);
+    int count = domain_count(result, words);
+    if (count > 0) {
+        for (int w = 0; w < words; w++) {
+            domain[w] = result[w];
+        }
+    }
 
-    return dest;
+    return count;
 }
 
-Tile *tile_rotate270(Tile *src) {
-    Tile *dest = calloc(1, sizeof(Tile));
-
-    dest->frequency = src->frequency;
-    dest->id = tile_id++;
+static inline __attribute__((always_inline)) float domain_entropy(TileSet *tile_set, const uint64_t *domain, int words) {
+    float total_weight = 0.0;
+    float max_weight = 0.0;
 
-    dest->img = ImageCopy(src->img);
-    ImageRotateCCW(&dest->img);
+    for (int w = 0; w < words; w++) {
+        for (uint64_t bits = domain[w]; bits; bits &= bits - 1) {
+            float weight = tile_set->weights[w * WORD_BITS + __builtin_ctzll(bits)];
+            total_weight += weight;
+            max_weight = MAX(max_weight, weight);
+        }
+    }
 
-    return dest;
+    return max_weight > 0.0 ? total_weight / max_weight : 0.0;
 }
 
-Tile *tile_mirror_horz(Tile *src) {
-    Tile *dest = calloc(1, sizeof(Tile));
-
-    dest->frequency = src->frequency;
-    dest->id = tile_id++;
+static inline __attribute__((always_inline)) int domain_pick(TileSet *tile_set, const uint64_t *domain, float v, int words) {
+    float total_weight = 0.0;
+    for (int w = 0; w < words; w++) {
+        for (uint64_t bits = domain[w]; bits; bits &= bits - 1) {
+            total_weight += tile_set->weights[w * WORD_BITS + __builtin_ctzll(bits)];
+        }
+    }
 
-    dest->img = ImageCopy(src->img);
-    ImageFlipHorizontal(&dest->img);
+    float target = v * total_weight;
+    int chosen = -1;
+    for (int w = 0; w < words; w++) {
+        for (uint64_t bits = domain[w]; bits; bits &= bits - 1) {
+            chosen = w * WORD_BITS + __builtin_ctzll(bits);
+            target -= tile_set->weights[chosen];
+            if (target < 0.0) {
+                return chosen;
+            }
+        }
+    }
 
-    return dest;
+    return chosen;
 }
 
-Tile *tile_mirror_vert(Tile *src) {
-    Tile *dest = calloc(1, sizeof(Tile));
-
-    dest->frequency = src->frequency;
-    dest->id = tile_id++;
+#define DEFINE_DOMAIN_KERNELS(name, words) \
+    static int name##_narrow(TileSet *tile_set, uint64_t *domain, uint64_t *const adj[NUM_DIRECTIONS]) { \
+        return domain_narrow(tile_set, domain, adj, words); \
+    } \
+    static int name##_count(TileSet *tile_set, const uint64_t *domain) { \
+        return domain_count(domain, words); \
+    } \
+    static float name##_entropy(TileSet *tile_set, const uint64_t *domain) { \
+        return domain_entropy(tile_set, domain, words); \
+    } \
+    static int name##_pick(TileSet *tile_set, const uint64_t *domain, float v) { \
+        return domain_pick(tile_set, domain, v, words); \
+    } \
+    static const DomainKernels name = {name##_narrow, name##_count, name##_entropy, name##_pick};
+
+DEFINE_DOMAIN_KERNELS(kernels_64, 1)
+DEFINE_DOMAIN_KERNELS(kernels_128, 2)
+DEFINE_DOMAIN_KERNELS(kernels_256, 4)
+DEFINE_DOMAIN_KERNELS(kernels_any, tile_set->num_words)
+
+enum Mirror {
+    MIRROR_NONE, MIRROR_HORZ, MIRROR_VERT
+};
 
-    dest->img = ImageCopy(src->img);
-    ImageFlipVertical(&dest->img);
+/*
+ * Writes `src` mirrored, then rotated clockwise by `quarter_turns`, straight
+ * into `dest`. Rotations assume a square tile.
+ */
+void tile_transform(uint8_t *dest, const uint8_t *src, int w, int h, enum Mirror mirror, int quarter_turns) {
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            int mx = mirror == MIRROR_HORZ ? w - 1 - x : x;
+            int my = mirror == MIRROR_VERT ? h - 1 - y : y;
+            int nx, ny;
+
+            switch (quarter_turns) {
+                case 1:
+                    nx = h - 1 - my;
+                    ny = mx;
+                    break;
+                case 2:
+                    nx = w - 1 - mx;
+                    ny = h - 1 - my;
+                    break;
+                case 3:
+                    nx = my;
+                    ny = w - 1 - mx;
+                    break;
+                default:
+                    nx = mx;
+                    ny = my;
+                    break;
+            }
 
-    return dest;
+            memcpy(dest + (ny * w + nx) * 3, src + (y * w + x) * 3, 3);
+        }
+    }
 }
 
 int tile_matches(Tile *a, Tile *b) {
@@ -173,555 +316,2185 @@ int tile_matches(Tile *a, Tile *b) {
     return result;
 }
 
+
+/* Fields are ordered to pack into 48 bytes, which adds up over millions of voxels */
 typedef struct Cell {
+    uint64_t *options;
+    uint64_t *base;
     int row;
     int col;
-    bool collapsed;
-    Tile **options;
+    int layer;
     int num_options;
-    float entropy;
+    int num_base;
     int heap_idx;
+    float entropy;
+    bool collapsed;
+    bool constrained;
     bool new;
 } Cell;
 
 typedef struct{
     Cell *cells;
+    uint64_t *option_pool;
+    uint64_t *base_pool;
+    int num_constrained;
     int rows;
     int cols;
+    int layers;
+    /* log2 of the block side, 0 when cells are stored row by row */
+    int block_shift;
+    /* log2 of the block height in layers, 0 for flat grids */
+    int layer_shift;
+    int blocks_per_row;
+    int blocks_per_layer;
+    /* Storage slots, counting the padding of partial blocks */
+    int num_cells;
 } Grid;
 
+/* Where the cell at r, c on layer z lives in `cells`; every cell index goes through here */
+static inline int grid_index(Grid *grid, int r, int c, int z) {
+    if (grid->block_shift == 0) {
+        return (z * grid->rows + r) * grid->cols + c;
+    }
+
+    int shift = grid->block_shift;
+    int mask = (1 << shift) - 1;
+    int layer_shift = grid->layer_shift;
+    int block = (z >> layer_shift) * grid->blocks_per_layer + (r >> shift) * grid->blocks_per_row + (c >> shift);
+    return (block << (2 * shift + layer_shift)) | ((z & ((1 << layer_shift) - 1)) << (2 * shift)) | ((r & mask) << shift) | (c & mask);
+}
+
+static inline int grid_size(Grid *grid) {
+    return grid->rows * grid->cols * grid->layers;
+}
+
+/*
+ * Ties are broken by scanline position, so the cell that comes out first only
+ * depends on the keys and never on the shape of the heap. That makes the heap
+ * a function of the cells, and a checkpoint can leave it out.
+ */
 typedef struct  {
-    int r;
-    int c;
+    int idx;
     float entropy;
+    int pos;
 } HeapNode;
 
-static HeapNode *min_heap = NULL;
-static int heap_size = 0;
+typedef struct {
+    int r;
+    int c;
+    int z;
+    int tile;
+} StackNode;
+
+typedef struct {
+    int idx;
+    int r;
+    int c;
+    int z;
+    int depth;
+} QueueNode;
+
+/*
+ * Picks the propagation depth while solving. Each setting runs for a window of
+ * steps and is scored by propagation work per decision that survived. Undoing
+ * a conflict costs the same at any depth and a window sees only a few, so the
+ * undo work of its first conflict is left out of the score. Exact
+ * propagation is measured first; then the tuner climbs the fixed depths from
+ * the old default while the score improves, turns around once, and stays on
+ * the best setting it saw. It stops early once its share of the solve is
+ * spent, so whatever it has not measured by then never beats exact
+ * propagation. Work is counted in cells visited, not time, so the choice only
+ * depends on the seed.
+ */
+typedef struct {
+    bool active;
+    bool turned;
+    int rung;
+    int best_rung;
+    float best_cost;
+    /* Best of the fixed depths, which the climb moves between */
+    int climb_rung;
+    float climb_cost;
+    int direction;
+    int window;
+    /* Steps left for exploring before the best setting is kept */
+    int budget;
+    int steps;
+    int conflicts;
+    long work_start;
+    /* Work spent undoing conflicts since work_start */
+    long undo_work;
+    int stack_start;
+} DepthTuner;
+
+/* Depths the tuner chooses from: exact propagation, then fixed depths shallowest first */
+static const int depth_ladder[] = {WFC_DEPTH_FULL, 1, 2, 3, 4, 6, 8, 12, 16, 24, 32};
+#define NUM_DEPTHS ((int) (sizeof(depth_ladder) / sizeof(depth_ladder[0])))
+#define TUNE_START_RUNG 4
+
+/* The part of the grid being solved, through every layer; everything outside is read-only */
+typedef struct {
+    int r;
+    int c;
+    int rows;
+    int cols;
+} Region;
+
+/*
+ * What the checkpoint log last recorded, so the next record only carries what
+ * changed since. Comparing against a copy at checkpoint time keeps solving
+ * itself free of any bookkeeping.
+ */
+typedef struct {
+    char *path;
+    FILE *file;
+    long size;
+    long snapshot_size;
+    /* Set when an append failed, so the next checkpoint starts a fresh log */
+    bool rewrite;
+
+    uint64_t *options;
+    float *entropy;
+    uint8_t *flags;
+    StackNode *stack;
+    uint64_t *stack_domains;
+    int stack_size;
+
+    /* Scratch list of the cells that changed, and where the last record's stack began */
+    int *changed;
+    int num_changed;
+    int stack_start;
+} Checkpoint;
+
+struct Wfc {
+    TileSet *tile_set;
+    Grid *grid;
+
+    HeapNode *min_heap;
+    int heap_size;
+
+    StackNode *stack;
+    /* Domain of each stacked cell from just before it was collapsed */
+    uint64_t *stack_domains;
+    int stack_size;
+
+    QueueNode *queue;
+    uint32_t *visited;
+    uint32_t visit_stamp;
+
+    Region region;
+
+    WfcHeuristic heuristic;
+    int depth;
+    DepthTuner tuner;
+    /* Cells visited by propagation and resets, the tuner's measure of cost */
+    long work;
+    bool conflict;
+    bool seeded;
+    bool failed;
+    uint64_t rng;
+    /* Drawn on every heap reset; the random heuristic keys cells by it */
+    uint64_t heap_salt;
+
+    Checkpoint *checkpoint;
+};
 
-static Grid *grid = NULL;
+/* splitmix64, so every solver owns its random stream */
+uint64_t rng_next(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+}
+
+float rng_float(uint64_t *state) {
+    return (rng_next(state) >> 40) * (1.0f / (1 << 24));
+}
 
-static int depth = 0;
+static inline bool heap_less(HeapNode a, HeapNode b) {
+    return a.entropy < b.entropy || (a.entropy == b.entropy && a.pos < b.pos);
+}
 
-void sift_up(int c) {
+void sift_up(Wfc *wfc, int c) {
+    HeapNode *min_heap = wfc->min_heap;
+    Grid *grid = wfc->grid;
     int p = (c - 1) / 2;
 
-    while (p >= 0 && min_heap[p].entropy > min_heap[c].entropy) {
+    while (p >= 0 && heap_less(min_heap[c], min_heap[p])) {
         HeapNode temp = min_heap[p];
         min_heap[p] = min_heap[c];
         min_heap[c] = temp;
 
-        grid->cells[min_heap[p].r * grid->cols + min_heap[p].c].heap_idx = p;
-        grid->cells[min_heap[c].r * grid->cols + min_heap[c].c].heap_idx = c;
+        grid->cells[min_heap[p].idx].heap_idx = p;
+        grid->cells[min_heap[c].idx].heap_idx = c;
 
         c = p;
         p = (c - 1) / 2;
     }
 }
 
-void sift_down(int p) {
-    while (p <= (heap_size - 2) / 2) {
-        int c = 2 * p + 1;
-        if (min_heap[c].entropy < min_heap[c + 1].entropy) {
-            if (min_heap[c].entropy < min_heap[p].entropy) {
-                HeapNode temp = min_heap[p];
-                min_heap[p] = min_heap[c];
-                min_heap[c] = temp;
+void sift_down(Wfc *wfc, int p) {
+    HeapNode *min_heap = wfc->min_heap;
+    Grid *grid = wfc->grid;
 
-                grid->cells[min_heap[p].r * grid->cols + min_heap[p].c].heap_idx = p;
-                grid->cells[min_heap[c].r * grid->cols + min_heap[c].c].heap_idx = c;
+    while (2 * p + 1 < wfc->heap_size) {
+        int c = 2 * p + 1;
+        if (c + 1 < wfc->heap_size && heap_less(min_heap[c + 1], min_heap[c])) {
+            c++;
+        }
 
-                p = c;
-            } else {
-                break;
-            }
-        } else {
-            if (min_heap[c + 1].entropy < min_heap[p].entropy) {
-                HeapNode temp = min_heap[p];
-                min_heap[p] = min_heap[c + 1];
-                min_heap[c + 1] = temp;
+        if (!heap_less(min_heap[c], min_heap[p])) {
+            break;
+        }
 
-                grid->cells[min_heap[p].r * grid->cols + min_heap[p].c].heap_idx = p;
-                grid->cells[min_heap[c + 1].r * grid->cols + min_heap[c + 1].c].heap_idx = c + 1;
+        HeapNode temp = min_heap[p];
+        min_heap[p] = min_heap[c];
+        min_heap[c] = temp;
 
-                p = c + 1;
-            } else {
-                break;
-            }
-        }
-   }
-}
+        grid->cells[min_heap[p].idx].heap_idx = p;
+        grid->cells[min_heap[c].idx].heap_idx = c;
 
-int find(int r, int c) {
-    for (int i = 0; i < heap_size; i++) {
-        if (min_heap[i].r == r && min_heap[i].c == c) {
-            return i;
-        }
+        p = c;
     }
-
-    return -1;
 }
 
-void heap_insert(HeapNode node) {
-    min_heap[heap_size++] = node;
-    grid->cells[node.r * grid->cols + node.c].heap_idx = heap_size - 1;
-    sift_up(heap_size - 1);
+void heap_insert(Wfc *wfc, HeapNode node) {
+    Grid *grid = wfc->grid;
+    wfc->min_heap[wfc->heap_size++] = node;
+    grid->cells[node.idx].heap_idx = wfc->heap_size - 1;
+    sift_up(wfc, wfc->heap_size - 1);
 }
 
-HeapNode heap_extract() {
+HeapNode heap_extract(Wfc *wfc) {
+    HeapNode *min_heap = wfc->min_heap;
+    Grid *grid = wfc->grid;
     HeapNode root = min_heap[0];
-    grid->cells[root.r * grid->cols + root.c].heap_idx = -1;
+    grid->cells[root.idx].heap_idx = -1;
 
-    min_heap[0] = min_heap[--heap_size];
-    grid->cells[min_heap[0].r * grid->cols + min_heap[0].c].heap_idx = 0;
-    sift_down(0);
+    if (--wfc->heap_size > 0) {
+        min_heap[0] = min_heap[wfc->heap_size];
+        grid->cells[min_heap[0].idx].heap_idx = 0;
+        sift_down(wfc, 0);
+    }
 
     return root;
 }
 
-HeapNode heap_remove(int idx) {
+HeapNode heap_remove(Wfc *wfc, int idx) {
     assert(idx >= 0);
+    HeapNode *min_heap = wfc->min_heap;
+    Grid *grid = wfc->grid;
     HeapNode node = min_heap[idx];
-    grid->cells[node.r * grid->cols + node.c].heap_idx = -1;
-
-    min_heap[idx] = min_heap[--heap_size];
-    grid->cells[min_heap[idx].r * grid->cols + min_heap[idx].c].heap_idx = idx;
-    sift_down(idx);
+    grid->cells[node.idx].heap_idx = -1;
+
+    if (idx != --wfc->heap_size) {
+        HeapNode last = min_heap[wfc->heap_size];
+        Cell *moved = &grid->cells[last.idx];
+        min_heap[idx] = last;
+        moved->heap_idx = idx;
+        sift_down(wfc, idx);
+        sift_up(wfc, moved->heap_idx);
+    }
 
     return node;
 }
 
-void heap_reset() {
-    heap_size = 0;
-    for (int i = 0; i < grid->rows; i++) {
-        for (int j = 0; j < grid->cols; j++) {
-            Cell *cell = &grid->cells[i * grid->cols + j];
-            if (!cell->collapsed) {
-                heap_insert((HeapNode) {.r = i, .c = j, .entropy = cell->entropy});
-            }
+/* Cells leave the heap lowest key first; the key depends on the heuristic */
+float heap_key(Wfc *wfc, Cell *cell, int pos) {
+    switch (wfc->heuristic) {
+        case WFC_SCANLINE:
+            /* Every key ties, so cells come out in position order */
+            return 0;
+        case WFC_RANDOM: {
+            uint64_t state = wfc->heap_salt ^ ((uint64_t) pos * 0xbf58476d1ce4e5b9);
+            return rng_float(&state);
         }
+        default:
+            return cell->entropy;
     }
 }
 
-
-void cell_collapse(Cell *cell) {
-    float *cumulative_weight = calloc(cell->num_options + 1, sizeof(float));
-    
-    for (int i = 0; i < cell->num_options; i++) {
-        cumulative_weight[i + 1] = cumulative_weight[i] + cell->options[i]->frequency;
+/* Puts every open cell of the region in the heap, under the current salt */
+static void heap_fill(Wfc *wfc) {
+    Grid *grid = wfc->grid;
+    Region *region = &wfc->region;
+    wfc->heap_size = 0;
+    for (int z = 0; z < grid->layers; z++) {
+        for (int i = region->r; i < region->r + region->rows; i++) {
+            for (int j = region->c; j < region->c + region->cols; j++) {
+                int idx = grid_index(grid, i, j, z);
+                int pos = (z * grid->rows + i) * grid->cols + j;
+                Cell *cell = &grid->cells[idx];
+                cell->heap_idx = -1;
+                if (!cell->collapsed) {
+                    heap_insert(wfc, (HeapNode) {.idx = idx, .entropy = heap_key(wfc, cell, pos), .pos = pos});
+                }
+            }
+        }
     }
+}
 
-    float v = ((float) rand()) / RAND_MAX * cumulative_weight[cell->num_options];
-
-    int l = 0;
-    int r = cell->num_options;
-
-    while (l <= r) {
-        int m = l + (r - l) / 2;
-        if (cumulative_weight[m] < v) {
-            l = m + 1;
-        } else {
-            r = m - 1;
-        }
+void heap_reset(Wfc *wfc) {
+    if (wfc->heuristic == WFC_RANDOM) {
+        wfc->heap_salt = rng_next(&wfc->rng);
     }
+    heap_fill(wfc);
+}
 
-    assert(0 <= r && r < cell->num_options);
+
+int cell_collapse(Cell *cell, TileSet *tile_set, uint64_t *rng) {
+    int chosen = tile_set->kernels->pick(tile_set, cell->options, rng_float(rng));
+    assert(chosen >= 0);
 
     cell->collapsed = true;
     cell->new = true;
-    Tile *chosen = cell->options[r];
-    Tile *tmp = cell->options[0];
-    cell->options[0] = chosen;
-    cell->options[r] = tmp;
+    memset(cell->options, 0, tile_set->num_words * sizeof(uint64_t));
+    domain_set(cell->options, chosen);
     cell->num_options = 1;
 
-    free(cumulative_weight);
+    return chosen;
 }
 
-float cell_calc_entropy(Cell *cell) {
-    float total_weight = 0.0;
-    float max_weight = 0.0;
-
-    if (cell->num_options == 0) {
-        return 0.0;
-    }
-
-    for (int i = 0; i < cell->num_options; i++) {
-        total_weight += cell->options[i]->frequency;
-        max_weight = MAX(max_weight, cell->options[i]->frequency);
-    }
-
-    return total_weight / max_weight;
+float cell_calc_entropy(Cell *cell, TileSet *tile_set) {
+    return tile_set->kernels->entropy(tile_set, cell->options);
 }
 
-void cell_reset(Cell *cell) {
-    memcpy(cell->options, tiles, num_tiles * sizeof(Tile *));
-    cell->num_options = num_tiles;
+/* Returns the cell to its starting domain; a cell fixed to one tile stays collapsed */
+void cell_reset(Cell *cell, TileSet *tile_set) {
+    memcpy(cell->options, cell->base, tile_set->num_words * sizeof(uint64_t));
+    cell->num_options = cell->num_base;
     cell->new = true;
-    cell->entropy = INFINITY;
-    cell->collapsed = false;
+    cell->entropy = cell->constrained ? cell_calc_entropy(cell, tile_set) : INFINITY;
+    cell->collapsed = cell->num_base == 1;
 }
 
-typedef struct {
-    int r;
-    int c;
-    int options;
-} StackNode;
-
-static StackNode *stack;
-static int stack_size = 0;
-
-Grid *grid_create(int rows, int cols) {
+Grid *grid_create(TileSet *tile_set, int rows, int cols, int layers, WfcLayout layout) {
+    int num_tiles = tile_set->num_tiles;
+    int words = tile_set->num_words;
     Grid *grid = malloc(sizeof(Grid));
-    *grid = (Grid) {.rows = rows, .cols = cols, .cells = malloc(rows * cols * sizeof(Cell))};
+    if (grid == NULL) {
+        return NULL;
+    }
+    *grid = (Grid) {
+        .rows = rows,
+        .cols = cols,
+        .layers = layers,
+        .num_cells = rows * cols * layers
+    };
+
+    if (layout == WFC_LAYOUT_BLOCKED) {
+        int shift = layers > 1 ? BRICK_SHIFT : BLOCK_SHIFT;
+        int side = 1 << shift;
+        int height = layers > 1 ? side : 1;
+        grid->block_shift = shift;
+        grid->layer_shift = layers > 1 ? shift : 0;
+        grid->blocks_per_row = (cols + side - 1) / side;
+        grid->blocks_per_layer = (rows + side - 1) / side * grid->blocks_per_row;
+        int64_t padded = (int64_t) ((layers + height - 1) / height) * grid->blocks_per_layer * side * side * height;
+        if (padded > INT32_MAX) {
+            free(grid);
+            return NULL;
+        }
+        grid->num_cells = padded;
+    }
+
+    grid->cells = malloc(grid->num_cells * sizeof(Cell));
+    grid->option_pool = malloc((size_t) grid->num_cells * words * sizeof(uint64_t));
+    if (grid->cells == NULL || grid->option_pool == NULL) {
+        free(grid->cells);
+        free(grid->option_pool);
+        free(grid);
+        return NULL;
+    }
 
-    for (int i = 0; i < rows * cols; i++) {
+    /* Padding slots are initialized too but never reached by row and column */
+    for (int i = 0; i < grid->num_cells; i++) {
         grid->cells[i] = (Cell) {
-            .row = i / cols,
-            .col = i % cols,
+            .row = -1,
+            .col = -1,
+            .layer = -1,
             .collapsed = false, 
             .new = false,
             .num_options = num_tiles, 
-            .options = malloc(num_tiles * sizeof(void *)), 
-            .entropy = INFINITY
+            .options = grid->option_pool + (size_t) i * words,
+            .base = tile_set->full,
+            .num_base = num_tiles,
+            .entropy = INFINITY,
+            .heap_idx = -1
         };
 
-        memcpy(grid->cells[i].options, tiles, num_tiles * sizeof(void *));
+        memcpy(grid->cells[i].options, tile_set->full, words * sizeof(uint64_t));
+    }
+
+    for (int z = 0; z < layers; z++) {
+        for (int i = 0; i < rows; i++) {
+            for (int j = 0; j < cols; j++) {
+                Cell *cell = &grid->cells[grid_index(grid, i, j, z)];
+                cell->row = i;
+                cell->col = j;
+                cell->layer = z;
+            }
+        }
+    }
+
+    return grid;
+}
+
+Grid *grid_clone(Grid *src, TileSet *tile_set) {
+    int num_cells = src->num_cells;
+    size_t pool_size = (size_t) num_cells * tile_set->num_words * sizeof(uint64_t);
+    Grid *grid = malloc(sizeof(Grid));
+    if (grid == NULL) {
+        return NULL;
+    }
+    *grid = *src;
+
+    grid->cells = malloc(num_cells * sizeof(Cell));
+    grid->option_pool = malloc(pool_size);
+    grid->base_pool = src->base_pool != NULL ? malloc(pool_size) : NULL;
+    if (grid->cells == NULL || grid->option_pool == NULL || (src->base_pool != NULL && grid->base_pool == NULL)) {
+        free(grid->cells);
+        free(grid->option_pool);
+        free(grid->base_pool);
+        free(grid);
+        return NULL;
+    }
+
+    memcpy(grid->cells, src->cells, num_cells * sizeof(Cell));
+    memcpy(grid->option_pool, src->option_pool, pool_size);
+    if (src->base_pool != NULL) {
+        memcpy(grid->base_pool, src->base_pool, pool_size);
+    }
+
+    for (int i = 0; i < num_cells; i++) {
+        Cell *cell = &grid->cells[i];
+        cell->options = grid->option_pool + (cell->options - src->option_pool);
+        if (cell->constrained) {
+            cell->base = grid->base_pool + (cell->base - src->base_pool);
+        }
     }
 
     return grid;
 }
 
 void grid_free(Grid *grid) {
+    free(grid->base_pool);
+    free(grid->option_pool);
     free(grid->cells);
     free(grid);
 }
 
-void grid_reset(Grid *grid) {
-    for (int i = 0; i < grid->rows * grid->cols; i++) {
-        Cell *cell = &grid->cells[i];
-        if (!cell->collapsed && cell->num_options != num_tiles) {
-            cell_reset(cell);
+void grid_reset(Grid *grid, TileSet *tile_set, Region *region) {
+    for (int z = 0; z < grid->layers; z++) {
+        for (int i = region->r; i < region->r + region->rows; i++) {
+            for (int j = region->c; j < region->c + region->cols; j++) {
+                Cell *cell = &grid->cells[grid_index(grid, i, j, z)];
+                if (!cell->collapsed && cell->num_options != cell->num_base) {
+                    cell_reset(cell, tile_set);
+                }
+            }
         }
     }
 }
 
-bool propogate_options(Grid *grid, int r, int c, int depth) {
-    typedef struct {
-        int r;
-        int c;
-        int depth;
-    } QueueNode;
+/* Narrows the starting domain of a cell to the tiles it shares with `allowed` */
+bool grid_restrict(Grid *grid, TileSet *tile_set, int idx, const uint64_t *allowed) {
+    Cell *cell = &grid->cells[idx];
+    int words = tile_set->num_words;
+
+    if (grid->base_pool == NULL) {
+        grid->base_pool = malloc((size_t) grid->num_cells * words * sizeof(uint64_t));
+    }
+
+    if (!cell->constrained) {
+        cell->base = grid->base_pool + (size_t) idx * words;
+        memcpy(cell->base, tile_set->full, words * sizeof(uint64_t));
+        cell->constrained = true;
+        grid->num_constrained++;
+    }
+
+    for (int w = 0; w < words; w++) {
+        cell->base[w] &= allowed[w];
+    }
+    cell->num_base = tile_set->kernels->count(tile_set, cell->base);
+
+    return cell->num_base > 0;
+}
 
+/*
+ * Breadth first from every source cell at once, so any number of seeds costs a
+ * single pass over the grid. Cells further than `depth` from the nearest
+ * source, or outside the active region, are left untouched.
+ *
+ * A negative `depth` propagates exactly instead: only sources and cells whose
+ * domain shrank pass the change on, and a cell is queued again whenever one of
+ * its neighbors changes, until nothing does.
+ */
+bool propogate_options(Wfc *wfc, const int *sources, int num_sources, int depth) {
+    Grid *grid = wfc->grid;
+    TileSet *tile_set = wfc->tile_set;
+    const DomainKernels *kernels = tile_set->kernels;
+    int words = tile_set->num_words;
+    Region *region = &wfc->region;
+    QueueNode *queue = wfc->queue;
+    uint32_t *visited = wfc->visited;
+    bool exact = depth < 0;
     bool conflict = false;
 
-    bool *visited = calloc(grid->rows * grid->cols, sizeof(bool));
-    int queue_size = grid->rows * grid->cols * 2;
-    QueueNode *queue = calloc(queue_size, sizeof(QueueNode));
+    if (++wfc->visit_stamp == 0) {
+        memset(visited, 0, grid->num_cells * sizeof(uint32_t));
+        wfc->visit_stamp = 1;
+    }
+    uint32_t stamp = wfc->visit_stamp;
+
+    static const int dr[NUM_DIRECTIONS] = {[UP] = -1, [DOWN] = 1};
+    static const int dc[NUM_DIRECTIONS] = {[RIGHT] = 1, [LEFT] = -1};
+    static const int dz[NUM_DIRECTIONS] = {[ABOVE] = 1, [BELOW] = -1};
+
+    /* A ring, since exact propagation can queue a cell more than once */
+    int capacity = grid_size(grid);
     int queue_start = 0;
-    int queue_end = 0;
+    int num_queued = 0;
 
-    queue[queue_end++] = (QueueNode) {.r = r, .c = c, .depth = 0};
-    visited[r * grid->cols + c] = true;
+    for (int i = 0; i < num_sources; i++) {
+        if (visited[sources[i]] != stamp) {
+            visited[sources[i]] = stamp;
+            Cell *cell = &grid->cells[sources[i]];
+            queue[num_queued++] = (QueueNode) {.idx = sources[i], .r = cell->row, .c = cell->col, .z = cell->layer, .depth = 0};
+        }
+    }
 
-    while (queue_end > queue_start) {
-        const QueueNode *node = &queue[queue_start++ % queue_size];
+    while (num_queued > 0) {
+        const QueueNode node = queue[queue_start];
+        queue_start = (queue_start + 1) % capacity;
+        num_queued--;
+        wfc->work++;
 
-        if (node->depth > depth) {
+        if (exact) {
+            /* Free to be queued again by the next neighbor that changes */
+            visited[node.idx] = 0;
+        } else if (node.depth > depth) {
             break;
         }
 
+        int r = node.r;
+        int c = node.c;
+        int z = node.z;
+        int adj[NUM_DIRECTIONS] = {-1, -1, -1, -1, -1, -1};
+
+        bool inside[NUM_DIRECTIONS] = {
+            [UP] = r > region->r,
+            [RIGHT] = c < region->c + region->cols - 1,
+            [DOWN] = r < region->r + region->rows - 1,
+            [LEFT] = c > region->c,
+            [ABOVE] = true,
+            [BELOW] = true
+        };
 
-        Cell *cell = &grid->cells[node->r * grid->cols + node->c];
-        Cell *adj[4] = {NULL, NULL, NULL, NULL};
+        if (r > 0) {
+            adj[UP] = grid_index(grid, r - 1, c, z);
+        }
 
-        /* Add adjacent cells to the queue */
-        if (node->r > 0) {
-            queue[queue_end++ % queue_size] = (QueueNode) {.r = node->r - 1, .c = node->c, .depth = node->depth + 1};
-            adj[UP] = &grid->cells[(node->r - 1) * grid->cols + node->c];
+        if (r < grid->rows - 1) {
+            adj[DOWN] = grid_index(grid, r + 1, c, z);
         }
 
-        if (node->r < grid->rows - 1) {
-            queue[queue_end++ % queue_size] = (QueueNode) {.r = node->r + 1, .c = node->c, .depth = node->depth + 1};
-            adj[DOWN] = &grid->cells[(node->r + 1) * grid->cols + node->c];
+        if (c > 0) {
+            adj[LEFT] = grid_index(grid, r, c - 1, z);
         }
 
-        if (node->c > 0) {
-            queue[queue_end++ % queue_size] = (QueueNode) {.r = node->r, .c = node->c - 1, .depth = node->depth + 1};
-            adj[LEFT] = &grid->cells[node->r * grid->cols + node->c - 1];
+        if (c < grid->cols - 1) {
+            adj[RIGHT] = grid_index(grid, r, c + 1, z);
         }
 
-        if (node->c < grid->cols - 1) {
-            queue[queue_end++ % queue_size] = (QueueNode) {.r = node->r, .c = node->c + 1, .depth = node->depth + 1};
-            adj[RIGHT] = &grid->cells[node->r * grid->cols + node->c + 1];
+        if (z < grid->layers - 1) {
+            adj[ABOVE] = grid_index(grid, r, c, z + 1);
         }
 
-        if (visited[node->r * grid->cols + node->c]) {
-            continue;
-        } 
-
-        visited[node->r * grid->cols + node->c] = true;
-
-        /* Take all options from neighbors */
-        if (!cell->collapsed) {
-            bool set_options[4][MAX_TILES] = {0, };
-
-            for (int i = 0; i < 4; i++) {
-                Cell *adj_cell = adj[i];
-                if (adj_cell != NULL) {
-                    for (int j = 0; j < adj_cell->num_options; j++) {
-                        Tile *opt = adj_cell->options[j];
-                        for (int k = 0; k < opt->num_options[(i + 2) % 4]; k++) {
-                            Tile *opt_adj = opt->options[(i + 2) % 4][k];
-                            set_options[i][opt_adj->id] = true;
-                        }
-                    }
-                } else {
-                    for (int j = 0; j < num_tiles; j++) {
-                        set_options[i][j] = true;
-                    }
+        if (z > 0) {
+            adj[BELOW] = grid_index(grid, r, c, z - 1);
+        }
+
+        /*
+         * Keep only the options every neighbor still supports. Only the dense
+         * domain pool is read here; the cell itself is touched when its domain
+         * shrinks. Single tile domains, collapsed cells among them, are left
+         * alone: a neighbor that cannot support them empties instead.
+         */
+        uint64_t *options = grid->option_pool + (size_t) node.idx * words;
+        int num_options = kernels->count(tile_set, options);
+        bool changed = false;
+
+        if (num_options > 1) {
+            uint64_t *adj_options[NUM_DIRECTIONS] = {NULL, };
+            for (int i = 0; i < NUM_DIRECTIONS; i++) {
+                if (adj[i] >= 0) {
+                    adj_options[i] = grid->option_pool + (size_t) adj[i] * words;
                 }
             }
 
-            int num_new_options = 0;
-            for (int i = 0; i < num_tiles; i++) {
-                bool all = true;
-                for (int j = 0; j < 4; j++) {
-                    all = all && set_options[j][i];
-                }
+            int num_new_options = kernels->narrow(tile_set, options, adj_options);
 
-                if (all) {
-                    cell->options[num_new_options++] = tiles[i];
-                }
+            if (num_new_options == 0) {
+                conflict = true;
+                break;
             }
 
-            if (num_new_options != cell->num_options) {
+            if (num_new_options != num_options) {
+                changed = true;
+                Cell *cell = &grid->cells[node.idx];
                 cell->num_options = num_new_options;
                 cell->new = true;
-                int idx = find(node->r, node->c);
-                // int idx2 = cell->heap_idx;
-                // assert(idx == idx2);
-                if (cell->num_options == 0) {
-                    conflict = true;
-                    break;
-                } else if (idx >= 0) {
-                    HeapNode heap_node = heap_remove(idx);
-                    heap_node.entropy = (cell->entropy = cell_calc_entropy(cell));
-                    heap_insert(heap_node);
+                cell->entropy = cell_calc_entropy(cell, tile_set);
+                if (cell->heap_idx >= 0 && wfc->heuristic == WFC_MIN_ENTROPY) {
+                    HeapNode heap_node = heap_remove(wfc, cell->heap_idx);
+                    heap_node.entropy = cell->entropy;
+                    heap_insert(wfc, heap_node);
                 }
             }
         }
-    }
 
-    free(queue);
-    free(visited);
+        if (exact && !changed && node.depth > 0) {
+            continue;
+        }
+
+        /* Add adjacent cells to the queue */
+        for (int i = 0; i < NUM_DIRECTIONS; i++) {
+            if (adj[i] >= 0 && inside[i] && visited[adj[i]] != stamp) {
+                visited[adj[i]] = stamp;
+                queue[(queue_start + num_queued++) % capacity] = (QueueNode) {.idx = adj[i], .r = r + dr[i], .c = c + dc[i], .z = z + dz[i], .depth = node.depth + 1};
+            }
+        }
+    }
 
     return !conflict;
 }
 
-void wfc_step();
-
-void wfc_init(int seed, int rows, int cols, char *tile_set, int max_depth) {
-    if (seed < 0) {
-        srand(time(NULL));
-    } else {
-        srand(seed);
+typedef struct {
+    void (*fn)(void *, int);
+    void *ctx;
+    int n;
+    int next;
+} ParallelWork;
+
+static void *parallel_main(void *arg) {
+    ParallelWork *work = arg;
+    int i;
+
+    while ((i = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED)) < work->n) {
+        work->fn(work->ctx, i);
     }
 
-    depth = max_depth;
-
-    grid = grid_create(rows, cols);
+    return NULL;
+}
 
-    char *dir_name = tile_set;
-    char schema[128];
-    int err = snprintf(schema, 127, "%s/schema", dir_name);
-    if (err < 0) {
-        exit(EXIT_FAILURE);
+/*
+ * Runs fn(ctx, i) for every i in [0, n), spread over one thread per core.
+ * The calling thread takes part, so it finishes whatever threads that could
+ * not be started would have done.
+ */
+static void parallel_for(int n, void (*fn)(void *, int), void *ctx) {
+    ParallelWork work = {.fn = fn, .ctx = ctx, .n = n, .next = 0};
+    int num_threads = MAX(MIN((int) sysconf(_SC_NPROCESSORS_ONLN), n), 1);
+    pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+    int started = 1;
+
+    while (threads != NULL && started < num_threads && pthread_create(&threads[started], NULL, parallel_main, &work) == 0) {
+        started++;
+    }
+    parallel_main(&work);
+    for (int i = 1; i < started; i++) {
+        pthread_join(threads[i], NULL);
     }
-    FILE *schema_file = fopen(schema, "r");
-    char *line = NULL;
-    size_t bytes = 0;
 
-    while (getline(&line, &bytes, schema_file) != EOF) {
-        char tile_name[128];
-        float weight;
-        int r90, r180, r270, mh, mv;
+    free(threads);
+}
 
-        sscanf(line, "%s %f %d %d %d %d %d", tile_name, &weight, &r90, &r180, &r270, &mh, &mv);
+typedef struct {
+    char file_name[256];
+    float weight;
+    bool rotate[4];
+    bool mirror[3];
+    Image img;
+} SchemaEntry;
 
-        char file_name[128];
-        int err = snprintf(file_name, 127, "%s/%s.png", dir_name, tile_name);
-        if (err < 0) {
-            exit(EXIT_FAILURE);
-        }
+typedef struct {
+    int entry;
+    enum Mirror mirror;
+    int quarter_turns;
+} Variant;
 
-        Tile *base_tile = tile_create_from_image(file_name, weight);
-        Tile *mh_tile = NULL;
-        Tile *mv_tile = NULL;
+typedef struct {
+    TileSet *tile_set;
+    SchemaEntry *entries;
+    Variant *variants;
+} TileSetLoad;
 
-        tiles[num_tiles++] = base_tile;
+static void tileset_decode(void *ctx, int i) {
+    SchemaEntry *entry = &((TileSetLoad *) ctx)->entries[i];
 
-        if (mh) {
-            mh_tile = tile_mirror_horz(base_tile);
-            tiles[num_tiles++] = mh_tile;
-        }
+    entry->img = LoadImage(entry->file_name);
+    if (entry->img.data != NULL) {
+        ImageFormat(&entry->img, PIXELFORMAT_UNCOMPRESSED_R8G8B8);
+    }
+}
 
-        if (mv) {
-            mv_tile = tile_mirror_horz(base_tile);
-            tiles[num_tiles++] = mv_tile;
-        }
+static void tileset_build_variant(void *ctx, int i) {
+    TileSetLoad *load = ctx;
+    Variant *variant = &load->variants[i];
+    SchemaEntry *entry = &load->entries[variant->entry];
+    Tile *tile = load->tile_set->tiles[i];
 
-        if (r90) {
-            tiles[num_tiles++] = tile_rotate90(base_tile);
+    tile_transform(tile->img.data, entry->img.data, tile->img.width, tile->img.height, variant->mirror, variant->quarter_turns);
+}
 
-            if (mh) {
-                tiles[num_tiles++] = tile_rotate90(mh_tile);
-            }
+/* Picks the kernels and allocates the empty rules once the tile count is known, returns the words per domain */
+static int tileset_init_domains(TileSet *tile_set) {
+    int num_tiles = tile_set->num_tiles;
+
+    /* Padding 129 to 256 tiles out to four words keeps them on a sized kernel */
+    if (num_tiles <= 64) {
+        tile_set->num_words = 1;
+        tile_set->kernels = &kernels_64;
+    } else if (num_tiles <= 128) {
+        tile_set->num_words = 2;
+        tile_set->kernels = &kernels_128;
+    } else if (num_tiles <= 256) {
+        tile_set->num_words = 4;
+        tile_set->kernels = &kernels_256;
+    } else {
+        tile_set->num_words = (num_tiles + WORD_BITS - 1) / WORD_BITS;
+        tile_set->kernels = &kernels_any;
+    }
 
-            if (mv) {
-                tiles[num_tiles++] = tile_rotate90(mv_tile);
-            }
-        }
+    int words = tile_set->num_words;
+    tile_set->full = calloc(words, sizeof(uint64_t));
+    tile_set->compat = calloc((size_t) NUM_DIRECTIONS * num_tiles * words, sizeof(uint64_t));
 
-        if (r180) {
-            tiles[num_tiles++] = tile_rotate180(base_tile);
+    for (int i = 0; i < num_tiles; i++) {
+        domain_set(tile_set->full, i);
+    }
 
-            if (mh) {
-                tiles[num_tiles++] = tile_rotate180(mh_tile);
-            }
+    return words;
+}
 
-            if (mv) {
-                tiles[num_tiles++] = tile_rotate180(mv_tile);
-            }
-        }
+#define MAX_SOCKET 32
+
+typedef struct {
+    float weight;
+    bool rotate;
+    char sockets[NUM_DIRECTIONS][MAX_SOCKET];
+} SocketEntry;
+
+/*
+ * Voxel tile sets have a `sockets` file instead of a schema, one tile a line:
+ *
+ *   <name> <weight> <up> <right> <down> <left> <above> <below> <rotate>
+ *
+ * Two faces that touch must carry the same socket label. With rotate set,
+ * the tile also comes turned a quarter, half and three quarters clockwise
+ * about the vertical axis.
+ */
+static TileSet *tileset_load_sockets(FILE *file) {
+    TileSet *tile_set = calloc(1, sizeof(TileSet));
+    SocketEntry *entries = NULL;
+    int num_entries = 0;
+    int max_entries = 0;
+    char *line = NULL;
+    size_t bytes = 0;
 
-        if (r270) {
-            tiles[num_tiles++] = tile_rotate270(base_tile);
+    while (getline(&line, &bytes, file) != EOF) {
+        SocketEntry entry;
+        char name[128];
+        int rotate;
 
-            if (mh) {
-                tiles[num_tiles++] = tile_rotate270(mh_tile);
-            }
+        if (sscanf(line, "%127s %f %31s %31s %31s %31s %31s %31s %d", name, &entry.weight,
+                    entry.sockets[UP], entry.sockets[RIGHT], entry.sockets[DOWN], entry.sockets[LEFT],
+                    entry.sockets[ABOVE], entry.sockets[BELOW], &rotate) != 9) {
+            continue;
+        }
+        entry.rotate = rotate;
 
-            if (mv) {
-                tiles[num_tiles++] = tile_rotate270(mv_tile);
-            }
+        if (num_entries == max_entries) {
+            max_entries = MAX(2 * max_entries, 16);
+            entries = realloc(entries, max_entries * sizeof(SocketEntry));
         }
+        entries[num_entries++] = entry;
     }
     free(line);
-    fclose(schema_file);
 
-    /* Define the adjacency rules for each tile */
-    for (int i = 0; i < num_tiles - 1; i++) {
-        for (int j = i;  j < num_tiles; j++) {
-            Tile *tile_a = tiles[i], *tile_b = tiles[j];
+    for (int i = 0; i < num_entries; i++) {
+        tile_set->num_tiles += entries[i].rotate ? 4 : 1;
+    }
 
-            int matches = tile_matches(tile_a, tile_b);
+    if (tile_set->num_tiles == 0) {
+        free(entries);
+        wfc_tileset_free(tile_set);
+        return NULL;
+    }
 
-            if (matches & UP_MATCH) {
-                tile_a->options[UP][tile_a->num_options[UP]++] = tile_b;
-                if (i != j) {
-                    tile_b->options[DOWN][tile_b->num_options[DOWN]++] = tile_a;
-                }
+    /* Lay the turned variants out in file order, as the picture loader does */
+    int num_tiles = tile_set->num_tiles;
+    SocketEntry *variants = malloc(num_tiles * sizeof(SocketEntry));
+    tile_set->voxels = true;
+    tile_set->tile_pool = calloc(num_tiles, sizeof(Tile));
+    tile_set->tiles = malloc(num_tiles * sizeof(Tile *));
+    tile_set->weights = malloc(num_tiles * sizeof(float));
+
+    int n = 0;
+    for (int i = 0; i < num_entries; i++) {
+        for (int turns = 0; turns < (entries[i].rotate ? 4 : 1); turns++) {
+            SocketEntry *variant = &variants[n];
+            *variant = entries[i];
+            for (int d = UP; d <= LEFT; d++) {
+                memcpy(variant->sockets[(d + turns) % 4], entries[i].sockets[d], MAX_SOCKET);
             }
 
-            if (matches & RIGHT_MATCH) {
-                tile_a->options[RIGHT][tile_a->num_options[RIGHT]++] = tile_b;
-                if (i != j) {
-                    tile_b->options[LEFT][tile_b->num_options[LEFT]++] = tile_a;
-                }
-            }
+            Tile *tile = &tile_set->tile_pool[n];
+            tile->frequency = variant->weight;
+            tile->id = n;
+            tile_set->tiles[n] = tile;
+            tile_set->weights[n] = tile->frequency;
+            n++;
+        }
+    }
+    free(entries);
 
-            if (matches & DOWN_MATCH) {
-                tile_a->options[DOWN][tile_a->num_options[DOWN]++] = tile_b;
-                if (i != j) {
-                    tile_b->options[UP][tile_b->num_options[UP]++] = tile_a;
-                }
-            }
+    int words = tileset_init_domains(tile_set);
 
-            if (matches & LEFT_MATCH) {
-                tile_a->options[LEFT][tile_a->num_options[LEFT]++] = tile_b;
-                if (i != j) {
-                    tile_b->options[RIGHT][tile_b->num_options[RIGHT]++] = tile_a;
+    for (int d = 0; d < NUM_DIRECTIONS; d++) {
+        for (int i = 0; i < num_tiles; i++) {
+            uint64_t *compat = tile_set->compat + ((size_t) d * num_tiles + i) * words;
+            for (int j = 0; j < num_tiles; j++) {
+                if (strcmp(variants[i].sockets[d], variants[j].sockets[opposite[d]]) == 0) {
+                    domain_set(compat, j);
                 }
             }
         }
     }
+    free(variants);
 
-    grid = grid_create(rows, cols);
+    return tile_set;
+}
 
-    /* Pick a random cell and collapse it */
-    int idx = rand() % (grid->rows * grid->cols);
-    
-    cell_collapse(&grid->cells[idx]);
+/*
+ * Loads in three passes: every PNG is decoded concurrently, the variants are
+ * laid out in schema order so tile ids never depend on timing, and then each
+ * variant is transformed concurrently into its slot of one pixel arena.
+ */
+TileSet *wfc_tileset_load(const char *dir_name) {
+    char schema[128];
+    int err = snprintf(schema, 127, "%s/sockets", dir_name);
+    if (err < 0) {
+        return NULL;
+    }
+    FILE *sockets_file = fopen(schema, "r");
+    if (sockets_file != NULL) {
+        TileSet *tile_set = tileset_load_sockets(sockets_file);
+        fclose(sockets_file);
+        return tile_set;
+    }
 
-    /* Intialize the min heap */
-    min_heap = malloc(grid->rows * grid->cols * sizeof(HeapNode));
+    snprintf(schema, 127, "%s/schema", dir_name);
+    FILE *schema_file = fopen(schema, "r");
+    if (schema_file == NULL) {
+        return NULL;
+    }
 
-    heap_reset();
+    TileSetLoad load = {.tile_set = calloc(1, sizeof(TileSet))};
+    TileSet *tile_set = load.tile_set;
+    int num_entries = 0;
+    int max_entries = 0;
+    char *line = NULL;
+    size_t bytes = 0;
 
-    /* Initialize the recursive stack */
-    stack = malloc(grid->rows * grid->cols * sizeof(StackNode));
+    while (getline(&line, &bytes, schema_file) != EOF) {
+        char tile_name[128];
+        float weight;
+        int r90, r180, r270, mh, mv;
+
+        if (sscanf(line, "%127s %f %d %d %d %d %d", tile_name, &weight, &r90, &r180, &r270, &mh, &mv) != 7) {
+            continue;
+        }
+
+        if (num_entries == max_entries) {
+            max_entries = MAX(2 * max_entries, 16);
+            load.entries = realloc(load.entries, max_entries * sizeof(SchemaEntry));
+        }
+
+        SchemaEntry *entry = &load.entries[num_entries++];
+        *entry = (SchemaEntry) {
+            .weight = weight,
+            .rotate = {true, r90, r180, r270},
+            .mirror = {true, mh, mv}
+        };
+        snprintf(entry->file_name, sizeof(entry->file_name), "%s/%s.png", dir_name, tile_name);
+    }
+    free(line);
+    fclose(schema_file);
+
+    parallel_for(num_entries, tileset_decode, &load);
+
+    bool ok = num_entries > 0;
+    int w = ok ? load.entries[0].img.width : 0;
+    int h = ok ? load.entries[0].img.height : 0;
+
+    /* Every variant gets its id up front, in schema order */
+    load.variants = malloc(MAX(num_entries, 1) * 12 * sizeof(Variant));
+    for (int i = 0; ok && i < num_entries; i++) {
+        SchemaEntry *entry = &load.entries[i];
+        ok = entry->img.data != NULL && entry->img.width == w && entry->img.height == h;
+
+        for (int turns = 0; ok && turns < 4; turns++) {
+            for (int mirror = MIRROR_NONE; ok && entry->rotate[turns] && mirror <= MIRROR_VERT; mirror++) {
+                if (entry->mirror[mirror]) {
+                    ok = turns == 0 || w == h;
+                    load.variants[tile_set->num_tiles++] = (Variant) {.entry = i, .mirror = mirror, .quarter_turns = turns};
+                }
+            }
+        }
+    }
+
+    if (ok) {
+        size_t tile_bytes = (size_t) w * h * 3;
+        tile_set->pixels = malloc(tile_set->num_tiles * tile_bytes);
+        tile_set->tile_pool = calloc(tile_set->num_tiles, sizeof(Tile));
+        tile_set->tiles = malloc(tile_set->num_tiles * sizeof(Tile *));
+        tile_set->weights = malloc(tile_set->num_tiles * sizeof(float));
+
+        for (int i = 0; i < tile_set->num_tiles; i++) {
+            Tile *tile = &tile_set->tile_pool[i];
+            tile->img = (Image) {
+                .data = tile_set->pixels + i * tile_bytes,
+                .width = w,
+                .height = h,
+                .mipmaps = 1,
+                .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8
+            };
+            tile->frequency = load.entries[load.variants[i].entry].weight;
+            tile->id = i;
+            tile_set->tiles[i] = tile;
+            tile_set->weights[i] = tile->frequency;
+        }
+
+        parallel_for(tile_set->num_tiles, tileset_build_variant, &load);
+    }
+
+    for (int i = 0; i < num_entries; i++) {
+        if (load.entries[i].img.data != NULL) {
+            UnloadImage(load.entries[i].img);
+        }
+    }
+    free(load.entries);
+    free(load.variants);
+
+    if (!ok) {
+        wfc_tileset_free(tile_set);
+        return NULL;
+    }
+
+    Tile **tiles = tile_set->tiles;
+    int num_tiles = tile_set->num_tiles;
+    int words = tileset_init_domains(tile_set);
+
+    #define COMPAT(dir, tile) (tile_set->compat + ((size_t) (dir) * num_tiles + (tile)) * words)
+
+    /* Define the adjacency rules for each tile */
+    for (int i = 0; i < num_tiles; i++) {
+        memcpy(COMPAT(ABOVE, i), tile_set->full, words * sizeof(uint64_t));
+        memcpy(COMPAT(BELOW, i), tile_set->full, words * sizeof(uint64_t));
+
+        for (int j = i;  j < num_tiles; j++) {
+            int matches = tile_matches(tiles[i], tiles[j]);
+
+            if (matches & UP_MATCH) {
+                domain_set(COMPAT(UP, i), j);
+                domain_set(COMPAT(DOWN, j), i);
+            }
+
+            if (matches & RIGHT_MATCH) {
+                domain_set(COMPAT(RIGHT, i), j);
+                domain_set(COMPAT(LEFT, j), i);
+            }
+
+            if (matches & DOWN_MATCH) {
+                domain_set(COMPAT(DOWN, i), j);
+                domain_set(COMPAT(UP, j), i);
+            }
+
+            if (matches & LEFT_MATCH) {
+                domain_set(COMPAT(LEFT, i), j);
+                domain_set(COMPAT(RIGHT, j), i);
+            }
+        }
+    }
+
+    #undef COMPAT
+
+    return tile_set;
+}
+
+void wfc_tileset_free(TileSet *tile_set) {
+    free(tile_set->compat);
+    free(tile_set->full);
+    free(tile_set->weights);
+    free(tile_set->tiles);
+    free(tile_set->tile_pool);
+    free(tile_set->pixels);
+    free(tile_set);
+}
+
+int wfc_tileset_num_tiles(TileSet *tile_set) {
+    return tile_set->num_tiles;
+}
+
+int wfc_tile_width(TileSet *tile_set) {
+    return tile_set->tiles[0]->img.width;
+}
+
+int wfc_tile_height(TileSet *tile_set) {
+    return tile_set->tiles[0]->img.height;
+}
+
+const unsigned char *wfc_tile_pixels(TileSet *tile_set, int tile) {
+    return tile_set->tiles[tile]->img.data;
+}
+
+Wfc *wfc_create(TileSet *tile_set, int seed, int rows, int cols, int depth) {
+    return wfc_create_3d(tile_set, seed, rows, cols, 1, depth);
+}
+
+Wfc *wfc_create_3d(TileSet *tile_set, int seed, int rows, int cols, int layers, int depth) {
+    /* Cells are counted in ints, padding of partial blocks included */
+    if (rows <= 0 || cols <= 0 || layers <= 0 || (int64_t) rows * cols * layers > INT32_MAX / 2) {
+        return NULL;
+    }
+
+    Wfc *wfc = calloc(1, sizeof(Wfc));
+    int num_cells = rows * cols * layers;
+
+    wfc->tile_set = tile_set;
+    wfc->depth = depth;
+
+    if (depth == WFC_DEPTH_AUTO) {
+        wfc->depth = depth_ladder[0];
+        wfc->tuner = (DepthTuner) {
+            .active = true,
+            .rung = 0,
+            .best_rung = 0,
+            .best_cost = INFINITY,
+            .climb_rung = TUNE_START_RUNG,
+            .climb_cost = INFINITY,
+            .direction = 1,
+            .window = MIN(MAX(num_cells / (4 * TUNE_SHARE), TUNE_MIN_WINDOW), TUNE_MAX_WINDOW),
+            .budget = MAX(num_cells / TUNE_SHARE, TUNE_MIN_WINDOW)
+        };
+    }
+    wfc->rng = seed < 0 ? (uint64_t) time(NULL) : (uint64_t) seed;
+
+    /* Volumes are blocked from the start so the layer above is never far away */
+    wfc->grid = grid_create(tile_set, rows, cols, layers, layers > 1 ? WFC_LAYOUT_BLOCKED : WFC_LAYOUT_ROWS);
+
+    /* Intialize the min heap */
+    wfc->min_heap = malloc(num_cells * sizeof(HeapNode));
+
+    /* Initialize the recursive stack */
+    wfc->stack = malloc(num_cells * sizeof(StackNode));
+    wfc->stack_domains = malloc((size_t) num_cells * tile_set->num_words * sizeof(uint64_t));
+
+    /* Propagation scratch space, reused by every pass */
+    wfc->queue = malloc(num_cells * sizeof(QueueNode));
+    wfc->visited = wfc->grid != NULL ? calloc(wfc->grid->num_cells, sizeof(uint32_t)) : NULL;
+
+    if (wfc->grid == NULL || wfc->min_heap == NULL || wfc->stack == NULL || wfc->stack_domains == NULL
+            || wfc->queue == NULL || wfc->visited == NULL) {
+        if (wfc->grid != NULL) {
+            grid_free(wfc->grid);
+        }
+        free(wfc->min_heap);
+        free(wfc->stack);
+        free(wfc->stack_domains);
+        free(wfc->queue);
+        free(wfc->visited);
+        free(wfc);
+        return NULL;
+    }
+
+    /* Seeding waits for the first step so constraints can be added first */
+    wfc->seeded = false;
+    wfc->region = (Region) {.r = 0, .c = 0, .rows = rows, .cols = cols};
+
+    return wfc;
+}
+
+static void checkpoint_free(Checkpoint *checkpoint) {
+    if (checkpoint == NULL) {
+        return;
+    }
+
+    if (checkpoint->file != NULL) {
+        fclose(checkpoint->file);
+    }
+    free(checkpoint->path);
+    free(checkpoint->options);
+    free(checkpoint->entropy);
+    free(checkpoint->flags);
+    free(checkpoint->stack);
+    free(checkpoint->stack_domains);
+    free(checkpoint->changed);
+    free(checkpoint);
+}
+
+void wfc_free(Wfc *wfc) {
+    grid_free(wfc->grid);
+    free(wfc->min_heap);
+    free(wfc->stack);
+    free(wfc->stack_domains);
+    free(wfc->queue);
+    free(wfc->visited);
+    checkpoint_free(wfc->checkpoint);
+    free(wfc);
+}
+
+/* A deep copy that shares only the tile set */
+static Wfc *wfc_clone(Wfc *src) {
+    int num_cells = grid_size(src->grid);
+    size_t domain_size = src->tile_set->num_words * sizeof(uint64_t);
+    Wfc *wfc = malloc(sizeof(Wfc));
+    if (wfc == NULL) {
+        return NULL;
+    }
+    *wfc = *src;
+
+    wfc->grid = grid_clone(src->grid, src->tile_set);
+    wfc->min_heap = malloc(num_cells * sizeof(HeapNode));
+    wfc->stack = malloc(num_cells * sizeof(StackNode));
+    wfc->stack_domains = malloc(num_cells * domain_size);
+    wfc->queue = malloc(num_cells * sizeof(QueueNode));
+    wfc->visited = calloc(src->grid->num_cells, sizeof(uint32_t));
+    wfc->visit_stamp = 0;
+    wfc->checkpoint = NULL;
+
+    if (wfc->grid == NULL || wfc->min_heap == NULL || wfc->stack == NULL || wfc->stack_domains == NULL
+            || wfc->queue == NULL || wfc->visited == NULL) {
+        if (wfc->grid != NULL) {
+            grid_free(wfc->grid);
+        }
+        free(wfc->min_heap);
+        free(wfc->stack);
+        free(wfc->stack_domains);
+        free(wfc->queue);
+        free(wfc->visited);
+        free(wfc);
+        return NULL;
+    }
+
+    memcpy(wfc->min_heap, src->min_heap, src->heap_size * sizeof(HeapNode));
+    memcpy(wfc->stack, src->stack, src->stack_size * sizeof(StackNode));
+    memcpy(wfc->stack_domains, src->stack_domains, src->stack_size * domain_size);
+
+    return wfc;
+}
+
+void wfc_set_heuristic(Wfc *wfc, WfcHeuristic heuristic) {
+    wfc->heuristic = heuristic;
+    wfc->seeded = false;
+}
+
+void wfc_set_layout(Wfc *wfc, WfcLayout layout) {
+    TileSet *tile_set = wfc->tile_set;
+    Grid *old = wfc->grid;
+
+    if ((old->block_shift != 0) == (layout == WFC_LAYOUT_BLOCKED)) {
+        return;
+    }
+    Grid *grid = grid_create(tile_set, old->rows, old->cols, old->layers, layout);
+    if (grid == NULL) {
+        return;
+    }
+
+    /* Constraints move with their cells; any progress is dropped */
+    for (int z = 0; z < grid->layers; z++) {
+        for (int i = 0; i < grid->rows; i++) {
+            for (int j = 0; j < grid->cols; j++) {
+                Cell *cell = &old->cells[grid_index(old, i, j, z)];
+                if (cell->constrained) {
+                    grid_restrict(grid, tile_set, grid_index(grid, i, j, z), cell->base);
+                }
+            }
+        }
+    }
+
+    grid_free(old);
+    wfc->grid = grid;
 
-    propogate_options(grid, idx / grid->cols, idx % grid->cols, depth);
+    /* Cells moved, so the next checkpoint starts a new log */
+    checkpoint_free(wfc->checkpoint);
+    wfc->checkpoint = NULL;
 
+    free(wfc->visited);
+    wfc->visited = calloc(grid->num_cells, sizeof(uint32_t));
+    wfc->visit_stamp = 0;
+    wfc->seeded = false;
 }
 
-void wfc_step() {
-    static bool conflict = false;
-    if (heap_size > 0 && !conflict) {
-        HeapNode root = heap_extract();
-        Cell *cell = &grid->cells[root.r * grid->cols + root.c];
-        stack[stack_size++] = (StackNode) {.r = root.r, .c = root.c, .options = cell->num_options};
-        cell_collapse(cell);
+static bool wfc_constrain(Wfc *wfc, int r, int c, int z, int rows, int cols, int layers, const bool *mask, const int *tiles, int num_tiles) {
+    Grid *grid = wfc->grid;
+    uint64_t allowed[wfc->tile_set->num_words];
+    memset(allowed, 0, sizeof(allowed));
 
-        if (!propogate_options(grid, root.r, root.c, depth)) {
-            conflict = true;
-            printf("CONFLICT\n");
+    if (r < 0 || c < 0 || z < 0 || rows <= 0 || cols <= 0 || layers <= 0 || r + rows > grid->rows || c + cols > grid->cols || z + layers > grid->layers) {
+        return false;
+    }
+
+    for (int i = 0; i < num_tiles; i++) {
+        if (tiles[i] < 0 || tiles[i] >= wfc->tile_set->num_tiles) {
+            return false;
         }
-    } else if (conflict) {
-        grid_reset(grid);
+        domain_set(allowed, tiles[i]);
+    }
+
+    bool ok = true;
+    for (int k = z; k < z + layers; k++) {
+        for (int i = r; i < r + rows; i++) {
+            for (int j = c; j < c + cols; j++) {
+                if (mask == NULL || mask[(i - r) * cols + (j - c)]) {
+                    ok = grid_restrict(grid, wfc->tile_set, grid_index(grid, i, j, k), allowed) && ok;
+                }
+            }
+        }
+    }
+
+    wfc->seeded = false;
+
+    return ok;
+}
 
-        StackNode top = stack[--stack_size];
-        Cell *prev = &grid->cells[top.r * grid->cols + top.c];
-        prev->num_options = top.options;
+bool wfc_fix(Wfc *wfc, int r, int c, int tile) {
+    return wfc_constrain(wfc, r, c, 0, 1, 1, wfc->grid->layers, NULL, &tile, 1);
+}
+
+bool wfc_fix_voxel(Wfc *wfc, int r, int c, int z, int tile) {
+    return wfc_constrain(wfc, r, c, z, 1, 1, 1, NULL, &tile, 1);
+}
+
+bool wfc_restrict(Wfc *wfc, int r, int c, int rows, int cols, const int *tiles, int num_tiles) {
+    return wfc_constrain(wfc, r, c, 0, rows, cols, wfc->grid->layers, NULL, tiles, num_tiles);
+}
+
+bool wfc_restrict_mask(Wfc *wfc, Image mask, const int *tiles, int num_tiles) {
+    Grid *grid = wfc->grid;
+
+    if (mask.width != grid->cols || mask.height != grid->rows) {
+        return false;
+    }
+
+    bool *selected = malloc(grid->rows * grid->cols * sizeof(bool));
+    for (int i = 0; i < grid->rows; i++) {
+        for (int j = 0; j < grid->cols; j++) {
+            Color color = GetImageColor(mask, j, i);
+            selected[i * grid->cols + j] = color.a > 0 && (color.r || color.g || color.b);
+        }
+    }
+
+    bool ok = wfc_constrain(wfc, 0, 0, 0, grid->rows, grid->cols, grid->layers, selected, tiles, num_tiles);
+    free(selected);
+
+    return ok;
+}
+
+void wfc_restart(Wfc *wfc) {
+    Grid *grid = wfc->grid;
+    wfc->region = (Region) {.r = 0, .c = 0, .rows = grid->rows, .cols = grid->cols};
+    int *sources = malloc(MAX(grid->num_constrained, 1) * sizeof(int));
+    int num_sources = 0;
+
+    for (int i = 0; i < grid->num_cells; i++) {
+        cell_reset(&grid->cells[i], wfc->tile_set);
+        if (grid->cells[i].constrained) {
+            sources[num_sources++] = i;
+        }
+    }
+
+    if (num_sources == 0) {
+        /* Pick a random cell and collapse it */
+        int pos = rng_next(&wfc->rng) % grid_size(grid);
+        int idx = grid_index(grid, pos / grid->cols % grid->rows, pos % grid->cols, pos / (grid->rows * grid->cols));
+
+        cell_collapse(&grid->cells[idx], wfc->tile_set, &wfc->rng);
+        sources[num_sources++] = idx;
+    }
+
+    heap_reset(wfc);
+
+    /* Every constraint goes out in the same pass */
+    wfc->conflict = !propogate_options(wfc, sources, num_sources, wfc->depth);
+
+    /* Constraints that contradict each other can never be solved */
+    wfc->failed = wfc->conflict && grid->num_constrained > 0;
+    wfc->seeded = true;
+    wfc->stack_size = 0;
+
+    free(sources);
+}
+
+/* Closes a window once enough steps have run on the current depth and moves on */
+static void depth_tune(Wfc *wfc) {
+    DepthTuner *tuner = &wfc->tuner;
+    if (!tuner->active) {
+        return;
+    }
+    tuner->steps++;
+    tuner->budget--;
+
+    /* A window that lost ground, through backtracking or a restart, scores worst */
+    int progress = wfc->stack_size - tuner->stack_start;
+    long work = wfc->work - tuner->work_start;
+    if (tuner->conflicts > 0) {
+        work -= tuner->undo_work / tuner->conflicts;
+    }
+    float cost = progress > 0 ? (float) work / progress : INFINITY;
+    float spent = (float) work / MAX(progress, 1);
+    bool losing = tuner->best_cost < INFINITY && tuner->steps >= TUNE_MIN_WINDOW
+        && spent > TUNE_ABANDON * tuner->best_cost;
+
+    if (!losing && tuner->budget > 0 && tuner->steps < tuner->window) {
+        return;
+    }
+
+    if (!losing && tuner->budget > 0 && tuner->conflicts < TUNE_MIN_CONFLICTS
+            && tuner->steps < TUNE_MAX_STRETCH * tuner->window) {
+        return;
+    }
+
+    if (cost < tuner->best_cost) {
+        tuner->best_cost = cost;
+        tuner->best_rung = tuner->rung;
+    }
+
+    int next = -1;
+    if (tuner->rung == 0) {
+        next = TUNE_START_RUNG;
+    } else if (cost < tuner->climb_cost) {
+        tuner->climb_cost = cost;
+        tuner->climb_rung = tuner->rung;
+        next = tuner->rung + tuner->direction;
+    } else if (!tuner->turned) {
+        tuner->turned = true;
+        tuner->direction = -tuner->direction;
+        next = tuner->climb_rung + tuner->direction;
+    }
+
+    if (next < 1 || next >= NUM_DEPTHS || tuner->budget <= 0) {
+        tuner->active = false;
+        next = tuner->best_rung;
+    }
+
+    tuner->rung = next;
+    tuner->steps = 0;
+    tuner->conflicts = 0;
+    tuner->work_start = wfc->work;
+    tuner->undo_work = 0;
+    tuner->stack_start = wfc->stack_size;
+    wfc->depth = depth_ladder[next];
+}
+
+WfcStatus wfc_step(Wfc *wfc) {
+    Grid *grid = wfc->grid;
+
+    if (!wfc->seeded) {
+        wfc_restart(wfc);
+    } else if (wfc->failed) {
+        return WFC_FAILED;
+    } else if (wfc->heap_size > 0 && !wfc->conflict) {
+        HeapNode root = heap_extract(wfc);
+        int idx = root.idx;
+        Cell *cell = &grid->cells[idx];
+        size_t domain_size = wfc->tile_set->num_words * sizeof(uint64_t);
+        memcpy(wfc->stack_domains + (size_t) wfc->stack_size * wfc->tile_set->num_words, cell->options, domain_size);
+        int tile = cell_collapse(cell, wfc->tile_set, &wfc->rng);
+        wfc->stack[wfc->stack_size++] = (StackNode) {.r = cell->row, .c = cell->col, .z = cell->layer, .tile = tile};
+
+        if (!propogate_options(wfc, &idx, 1, wfc->depth)) {
+            wfc->conflict = true;
+            wfc->tuner.conflicts++;
+            return WFC_CONFLICT;
+        }
+    } else if (wfc->conflict && wfc->stack_size == 0 && wfc->region.rows * wfc->region.cols < grid->rows * grid->cols) {
+        /* The fixed cells around the region leave it no solution */
+        wfc->failed = true;
+    } else if (wfc->conflict && wfc->stack_size == 0) {
+        /* Every decision has been exhausted */
+        wfc_restart(wfc);
+    } else if (wfc->conflict) {
+        long work_start = wfc->work;
+        grid_reset(grid, wfc->tile_set, &wfc->region);
+        /* This reset and the heap_reset below both walk the region */
+        wfc->work += 2 * wfc->region.rows * wfc->region.cols * grid->layers;
+
+        /* Undo the last decision and rule out the tile it chose */
+        StackNode top = wfc->stack[--wfc->stack_size];
+        int idx = grid_index(grid, top.r, top.c, top.z);
+        Cell *prev = &grid->cells[idx];
+        memcpy(prev->options, wfc->stack_domains + (size_t) wfc->stack_size * wfc->tile_set->num_words, wfc->tile_set->num_words * sizeof(uint64_t));
+        domain_clear(prev->options, top.tile);
+        prev->num_options = wfc->tile_set->kernels->count(wfc->tile_set, prev->options);
         prev->new = true;
         prev->collapsed = false;
-        if (prev->num_options != 0) {
-            Tile *tmp = prev->options[0];
-            prev->options[0] = prev->options[prev->num_options - 1];
-            prev->options[prev->num_options - 1] = tmp;
-            prev->num_options--;
-        } else {
-            cell_reset(prev);
+
+        heap_reset(wfc);
+
+        bool consistent = propogate_options(wfc, &idx, 1, wfc->region.rows * wfc->region.cols * grid->layers);
+
+        if (prev->num_options != 0 && consistent) {
+            wfc->conflict = false;
         }
+        wfc->tuner.undo_work += wfc->work - work_start;
+    } else {
+        return WFC_DONE;
+    }
 
-        heap_reset();
+    depth_tune(wfc);
 
-        if (prev->num_options != 0) {
-            conflict = false;
+    return wfc->failed ? WFC_FAILED : WFC_RUNNING;
+}
+
+bool wfc_solve(Wfc *wfc, long max_steps) {
+    for (long i = 0; max_steps < 0 || i < max_steps; i++) {
+        WfcStatus status = wfc_step(wfc);
+        if (status == WFC_DONE) {
+            return true;
+        } else if (status == WFC_FAILED) {
+            return false;
         }
+    }
 
-        propogate_options(grid, top.r, top.c, grid->rows * grid->cols);
-    } else {
-        /* Start over */
-        for (int i = 0; i < grid->rows * grid->cols; i++) {
-            cell_reset(&grid->cells[i]);
+    return false;
+}
+
+/*
+ * Re-rolls a rectangle of a finished map, leaving the rest of it as is. The
+ * region restarts from its starting domains narrowed by the fixed cells around
+ * it, and only its cells are searched. When the surroundings leave it no
+ * solution the region grows by half its size on every side and tries again,
+ * up to the whole grid.
+ */
+bool wfc_regenerate(Wfc *wfc, int r, int c, int rows, int cols, long max_steps) {
+    Grid *grid = wfc->grid;
+
+    int r0 = MAX(r, 0), c0 = MAX(c, 0);
+    int r1 = MIN(r + rows, grid->rows), c1 = MIN(c + cols, grid->cols);
+    if (r0 >= r1 || c0 >= c1) {
+        return false;
+    }
+
+    for (;;) {
+        wfc->region = (Region) {.r = r0, .c = c0, .rows = r1 - r0, .cols = c1 - c0};
+        int *sources = malloc((r1 - r0) * (c1 - c0) * grid->layers * sizeof(int));
+        int num_sources = 0;
+
+        for (int z = 0; z < grid->layers; z++) {
+            for (int i = r0; i < r1; i++) {
+                for (int j = c0; j < c1; j++) {
+                    int idx = grid_index(grid, i, j, z);
+                    cell_reset(&grid->cells[idx], wfc->tile_set);
+                    sources[num_sources++] = idx;
+                }
+            }
         }
 
-        /* Pick a random cell and collapse it */
-        int idx = rand() % (grid->rows * grid->cols);
-        
-        cell_collapse(&grid->cells[idx]);
+        heap_reset(wfc);
+
+        wfc->conflict = !propogate_options(wfc, sources, num_sources, wfc->depth);
+        wfc->failed = false;
+        wfc->seeded = true;
+        wfc->stack_size = 0;
+
+        free(sources);
+
+        if (wfc_solve(wfc, max_steps)) {
+            return true;
+        }
+
+        if (r1 - r0 == grid->rows && c1 - c0 == grid->cols) {
+            return false;
+        }
+
+        int grow_r = MAX((r1 - r0) / 2, 1), grow_c = MAX((c1 - c0) / 2, 1);
+        r0 = MAX(r0 - grow_r, 0);
+        c0 = MAX(c0 - grow_c, 0);
+        r1 = MIN(r1 + grow_r, grid->rows);
+        c1 = MIN(c1 + grow_c, grid->cols);
+    }
+}
+
+typedef struct {
+    Wfc **instances;
+    int num_instances;
+    long max_steps;
+    WfcStatus *status;
+    /* What each instance had spent when it finished */
+    long *work;
+    /* Where each instance's current epoch ends, and the steps it has taken */
+    long *budget;
+    long *steps;
+    int winner;
+    bool stop;
+    /* Held until every thread that could be started is, and the barrier sized to them */
+    pthread_mutex_t start;
+    int num_threads;
+    pthread_barrier_t barrier;
+} Portfolio;
+
+typedef struct {
+    Portfolio *portfolio;
+    int thread;
+} PortfolioWorker;
+
+/* Runs one instance through its next epoch */
+static void portfolio_epoch(Portfolio *portfolio, int idx) {
+    Wfc *wfc = portfolio->instances[idx];
+    WfcStatus status = portfolio->status[idx];
+
+    portfolio->budget[idx] += PORTFOLIO_EPOCH_WORK;
+    while (wfc->work < portfolio->budget[idx] && status != WFC_DONE && status != WFC_FAILED) {
+        if (portfolio->max_steps >= 0 && portfolio->steps[idx] >= portfolio->max_steps) {
+            /* Out of steps counts as giving up */
+            status = WFC_FAILED;
+            break;
+        }
+        status = wfc_step(wfc);
+        portfolio->steps[idx]++;
+    }
+    portfolio->status[idx] = status;
+    portfolio->work[idx] = wfc->work;
+}
 
-        heap_reset();
+/*
+ * Instances run in lock step, PORTFOLIO_EPOCH_WORK cells of propagation and
+ * resets at a time, so one that backtracks a lot takes fewer steps per epoch
+ * instead of holding the others back. Work follows wall time but, unlike it,
+ * only depends on the seed, and so does the race however many threads share
+ * the instances. Between epochs one thread looks at the results and either
+ * lets everyone continue or calls the race for the instance that finished on
+ * the least work, the lowest index on a tie.
+ */
+static void *portfolio_main(void *arg) {
+    PortfolioWorker *worker = arg;
+    Portfolio *portfolio = worker->portfolio;
+
+    pthread_mutex_lock(&portfolio->start);
+    pthread_mutex_unlock(&portfolio->start);
+
+    while (!portfolio->stop) {
+        for (int i = worker->thread; i < portfolio->num_instances; i += portfolio->num_threads) {
+            portfolio_epoch(portfolio, i);
+        }
+
+        if (pthread_barrier_wait(&portfolio->barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+            bool all_failed = true;
+            for (int i = 0; i < portfolio->num_instances; i++) {
+                int best = portfolio->winner;
+                if (portfolio->status[i] == WFC_DONE && (best < 0 || portfolio->work[i] < portfolio->work[best])) {
+                    portfolio->winner = i;
+                }
+                all_failed = all_failed && portfolio->status[i] == WFC_FAILED;
+            }
+
+            portfolio->stop = portfolio->winner >= 0 || all_failed;
+        }
+
+        pthread_barrier_wait(&portfolio->barrier);
+    }
 
-        propogate_options(grid, idx / grid->rows, idx % grid->cols, depth);
+    return NULL;
+}
 
-        stack_size = 0;
+static void portfolio_free(Portfolio *portfolio, int num_clones) {
+    for (int i = 1; i < num_clones; i++) {
+        wfc_free(portfolio->instances[i]);
     }
+    free(portfolio->instances);
+    free(portfolio->status);
+    free(portfolio->work);
+    free(portfolio->budget);
+    free(portfolio->steps);
 }
 
-void wfc_draw(Texture texture) {
+/*
+ * Races `num_instances` copies of the solver, constraints included, each with
+ * a seed derived from the solver's and a rotating choice of heuristic. The
+ * first instance to finish replaces the solver's state. The copies share one
+ * thread per core, the calling thread included, or fewer if threads cannot be
+ * started. If the copies do not fit in memory nothing is solved and errno is
+ * set to ENOMEM.
+ */
+bool wfc_solve_portfolio(Wfc *wfc, int num_instances, long max_steps) {
+    if (num_instances <= 1) {
+        return wfc_solve(wfc, max_steps);
+    }
+
+    static const WfcHeuristic heuristics[] = {WFC_MIN_ENTROPY, WFC_SCANLINE, WFC_RANDOM};
+
+    Portfolio portfolio = {
+        .instances = malloc(num_instances * sizeof(Wfc *)),
+        .num_instances = num_instances,
+        .max_steps = max_steps,
+        .status = calloc(num_instances, sizeof(WfcStatus)),
+        .work = calloc(num_instances, sizeof(long)),
+        .budget = calloc(num_instances, sizeof(long)),
+        .steps = calloc(num_instances, sizeof(long)),
+        .winner = -1,
+        .stop = false
+    };
+    if (portfolio.instances == NULL || portfolio.status == NULL || portfolio.work == NULL
+            || portfolio.budget == NULL || portfolio.steps == NULL) {
+        portfolio_free(&portfolio, 0);
+        errno = ENOMEM;
+        return false;
+    }
+
+    int num_clones = 1;
+    portfolio.instances[0] = wfc;
+    while (num_clones < num_instances) {
+        Wfc *instance = wfc_clone(wfc);
+        if (instance == NULL) {
+            /* Racing fewer would change the result */
+            portfolio_free(&portfolio, num_clones);
+            errno = ENOMEM;
+            return false;
+        }
+        uint64_t derived = wfc->rng ^ (0x9e3779b97f4a7c15 * num_clones);
+        instance->rng = rng_next(&derived);
+        wfc_set_heuristic(instance, heuristics[num_clones % 3]);
+        portfolio.instances[num_clones++] = instance;
+    }
+    for (int i = 0; i < num_instances; i++) {
+        portfolio.budget[i] = portfolio.instances[i]->work;
+    }
+
+    int max_threads = MAX(MIN((int) sysconf(_SC_NPROCESSORS_ONLN), num_instances), 1);
+    pthread_t *threads = malloc(max_threads * sizeof(pthread_t));
+    PortfolioWorker *workers = malloc(max_threads * sizeof(PortfolioWorker));
+    if (threads == NULL || workers == NULL) {
+        free(threads);
+        free(workers);
+        portfolio_free(&portfolio, num_clones);
+        errno = ENOMEM;
+        return false;
+    }
+
+    /* Threads deal out the instances once it is known how many started */
+    pthread_mutex_init(&portfolio.start, NULL);
+    pthread_mutex_lock(&portfolio.start);
+    portfolio.num_threads = 1;
+    workers[0] = (PortfolioWorker) {.portfolio = &portfolio, .thread = 0};
+    while (portfolio.num_threads < max_threads) {
+        int t = portfolio.num_threads;
+        workers[t] = (PortfolioWorker) {.portfolio = &portfolio, .thread = t};
+        if (pthread_create(&threads[t], NULL, portfolio_main, &workers[t]) != 0) {
+            break;
+        }
+        portfolio.num_threads++;
+    }
+    pthread_barrier_init(&portfolio.barrier, NULL, portfolio.num_threads);
+    pthread_mutex_unlock(&portfolio.start);
+
+    portfolio_main(&workers[0]);
+    for (int i = 1; i < portfolio.num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    /* Hand the winning state to the caller's solver */
+    if (portfolio.winner > 0) {
+        Wfc tmp = *wfc;
+        *wfc = *portfolio.instances[portfolio.winner];
+        *portfolio.instances[portfolio.winner] = tmp;
+
+        /* The checkpoint log stays with the caller */
+        wfc->checkpoint = tmp.checkpoint;
+        portfolio.instances[portfolio.winner]->checkpoint = NULL;
+    }
+
+    bool solved = portfolio.winner >= 0;
+
+    pthread_barrier_destroy(&portfolio.barrier);
+    pthread_mutex_destroy(&portfolio.start);
+    portfolio_free(&portfolio, num_clones);
+    free(threads);
+    free(workers);
+
+    return solved;
+}
+
+/*
+ * A checkpoint log is a header followed by records, each taking the solver
+ * from the state of the record before it to a newer one; the first record of
+ * a log carries everything. Records hold the solver's scalars, then the cells
+ * that changed and the top of the stack that did; the heap is rebuilt from the
+ * cells. Everything is
+ * in native layout and 8 byte aligned so a log replays straight out of an
+ * mmap. A record cut short by a crash fails its checksum, and the log is
+ * replayed up to the record before it.
+ */
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t rows;
+    uint32_t cols;
+    uint32_t layers;
+    uint32_t num_tiles;
+    uint32_t num_cells;
+    uint32_t block_shift;
+} CheckpointHeader;
+
+typedef struct {
+    char magic[4];
+    uint32_t crc;
+    uint64_t size;
+} RecordHeader;
+
+typedef struct {
+    uint64_t rng;
+    uint64_t heap_salt;
+    int64_t work;
+    DepthTuner tuner;
+    Region region;
+    int32_t heuristic;
+    int32_t depth;
+    uint32_t visit_stamp;
+    /* Stack entries from stack_start up to stack_size follow the cells */
+    int32_t stack_start;
+    int32_t stack_size;
+    uint32_t num_cells;
+    uint8_t conflict;
+    uint8_t seeded;
+    uint8_t failed;
+} RecordState;
+
+/* Followed by the cell's domain */
+typedef struct {
+    uint32_t idx;
+    float entropy;
+    uint32_t flags;
+    uint32_t reserved;
+} CellEntry;
+
+#define CELL_COLLAPSED 1
+#define CELL_NEW 2
+
+static uint8_t cell_flags(Cell *cell) {
+    return (cell->collapsed ? CELL_COLLAPSED : 0) | (cell->new ? CELL_NEW : 0);
+}
+
+static Checkpoint *checkpoint_create(Wfc *wfc, const char *path) {
+    int num_cells = wfc->grid->num_cells;
+    int words = wfc->tile_set->num_words;
+    Checkpoint *checkpoint = calloc(1, sizeof(Checkpoint));
+
+    checkpoint->path = strdup(path);
+    checkpoint->options = malloc((size_t) num_cells * words * sizeof(uint64_t));
+    checkpoint->entropy = malloc(num_cells * sizeof(float));
+    checkpoint->flags = malloc(num_cells);
+    checkpoint->stack = malloc(grid_size(wfc->grid) * sizeof(StackNode));
+    checkpoint->stack_domains = malloc((size_t) grid_size(wfc->grid) * words * sizeof(uint64_t));
+    checkpoint->changed = malloc(num_cells * sizeof(int));
+
+    return checkpoint;
+}
+
+/* Streams part of a record's payload, keeping its checksum */
+static bool record_put(FILE *file, uLong *crc, uint64_t *size, const void *data, size_t bytes) {
+    *crc = crc32(*crc, data, bytes);
+    *size += bytes;
+    return fwrite(data, 1, bytes, file) == bytes;
+}
+
+/*
+ * Appends a record of everything that differs from the last one, or of the
+ * whole state when `full` is set. The header goes in last, so a record that
+ * was never finished cannot pass for one. The copy is left alone until
+ * checkpoint_commit, once the record is known to be part of the log.
+ */
+static bool checkpoint_record(Wfc *wfc, FILE *file, bool full) {
+    Checkpoint *checkpoint = wfc->checkpoint;
+    Grid *grid = wfc->grid;
+    int words = wfc->tile_set->num_words;
+    size_t domain_size = words * sizeof(uint64_t);
+
+    int num_cells = 0;
+    for (int i = 0; i < grid->num_cells; i++) {
+        Cell *cell = &grid->cells[i];
+        if (full || checkpoint->flags[i] != cell_flags(cell)
+                || memcmp(&checkpoint->entropy[i], &cell->entropy, sizeof(float)) != 0
+                || memcmp(checkpoint->options + (size_t) i * words, cell->options, domain_size) != 0) {
+            checkpoint->changed[num_cells++] = i;
+        }
+    }
+
+    /* Everything below the first entry that moved is already on record */
+    int stack_start = 0;
+    int common = full ? 0 : MIN(checkpoint->stack_size, wfc->stack_size);
+    while (stack_start < common && memcmp(&checkpoint->stack[stack_start], &wfc->stack[stack_start], sizeof(StackNode)) == 0
+            && memcmp(checkpoint->stack_domains + (size_t) stack_start * words, wfc->stack_domains + (size_t) stack_start * words, domain_size) == 0) {
+        stack_start++;
+    }
+
+    RecordState state;
+    memset(&state, 0, sizeof(state));
+    state.rng = wfc->rng;
+    state.heap_salt = wfc->heap_salt;
+    state.work = wfc->work;
+    state.tuner = wfc->tuner;
+    state.region = wfc->region;
+    state.heuristic = wfc->heuristic;
+    state.depth = wfc->depth;
+    state.visit_stamp = wfc->visit_stamp;
+    state.stack_start = stack_start;
+    state.stack_size = wfc->stack_size;
+    state.num_cells = num_cells;
+    state.conflict = wfc->conflict;
+    state.seeded = wfc->seeded;
+    state.failed = wfc->failed;
+
+    long start = ftell(file);
+    RecordHeader header = {.magic = {'W', 'F', 'C', 'R'}};
+    uLong crc = crc32(0, NULL, 0);
+    bool ok = start >= 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = ok && record_put(file, &crc, &header.size, &state, sizeof(state));
+
+    for (int i = 0; ok && i < num_cells; i++) {
+        Cell *cell = &grid->cells[checkpoint->changed[i]];
+        CellEntry entry = {
+            .idx = checkpoint->changed[i],
+            .entropy = cell->entropy,
+            .flags = cell_flags(cell)
+        };
+        ok = record_put(file, &crc, &header.size, &entry, sizeof(entry));
+        ok = ok && record_put(file, &crc, &header.size, cell->options, domain_size);
+    }
+
+    for (int i = stack_start; ok && i < wfc->stack_size; i++) {
+        ok = record_put(file, &crc, &header.size, &wfc->stack[i], sizeof(StackNode));
+        ok = ok && record_put(file, &crc, &header.size, wfc->stack_domains + (size_t) i * words, domain_size);
+    }
+
+    header.crc = crc;
+    ok = ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = ok && fseek(file, start, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = ok && fseek(file, 0, SEEK_END) == 0 && fflush(file) == 0 && fsync(fileno(file)) == 0;
+
+    checkpoint->num_changed = num_cells;
+    checkpoint->stack_start = stack_start;
+    return ok;
+}
+
+/* Brings the copy up to date with the record just written to `file` */
+static void checkpoint_commit(Wfc *wfc, FILE *file) {
+    Checkpoint *checkpoint = wfc->checkpoint;
+    Grid *grid = wfc->grid;
+    int words = wfc->tile_set->num_words;
+    size_t domain_size = words * sizeof(uint64_t);
+    int num_cells = checkpoint->num_changed;
+    int stack_start = checkpoint->stack_start;
+
+    for (int i = 0; i < num_cells; i++) {
+        int idx = checkpoint->changed[i];
+        Cell *cell = &grid->cells[idx];
+        checkpoint->flags[idx] = cell_flags(cell);
+        checkpoint->entropy[idx] = cell->entropy;
+        memcpy(checkpoint->options + (size_t) idx * words, cell->options, domain_size);
+    }
+
+    memcpy(checkpoint->stack + stack_start, wfc->stack + stack_start, (wfc->stack_size - stack_start) * sizeof(StackNode));
+    memcpy(checkpoint->stack_domains + (size_t) stack_start * words, wfc->stack_domains + (size_t) stack_start * words,
+           (wfc->stack_size - stack_start) * domain_size);
+    checkpoint->stack_size = wfc->stack_size;
+
+    checkpoint->size = ftell(file);
+}
+
+/* Starts the log over with one full record, swapped in only once it is on disk */
+static bool checkpoint_rewrite(Wfc *wfc) {
+    Checkpoint *checkpoint = wfc->checkpoint;
+    Grid *grid = wfc->grid;
+
+    size_t len = strlen(checkpoint->path);
+    char *tmp_path = malloc(len + 5);
+    memcpy(tmp_path, checkpoint->path, len);
+    memcpy(tmp_path + len, ".tmp", 5);
+
+    FILE *file = fopen(tmp_path, "w+b");
+    if (file == NULL) {
+        free(tmp_path);
+        checkpoint->rewrite = true;
+        return false;
+    }
+
+    CheckpointHeader header = {
+        .magic = {'W', 'F', 'C', 'K'},
+        .version = CHECKPOINT_VERSION,
+        .rows = grid->rows,
+        .cols = grid->cols,
+        .layers = grid->layers,
+        .num_tiles = wfc->tile_set->num_tiles,
+        .num_cells = grid->num_cells,
+        .block_shift = grid->block_shift
+    };
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 && checkpoint_record(wfc, file, true);
+    ok = ok && rename(tmp_path, checkpoint->path) == 0;
+
+    if (!ok) {
+        /* The old log, if any, still stands as it was, so keep the copy matching it */
+        fclose(file);
+        unlink(tmp_path);
+        free(tmp_path);
+        checkpoint->rewrite = true;
+        return false;
+    }
+    free(tmp_path);
+
+    checkpoint_commit(wfc, file);
+    if (checkpoint->file != NULL) {
+        fclose(checkpoint->file);
+    }
+    checkpoint->file = file;
+    checkpoint->snapshot_size = checkpoint->size;
+    checkpoint->rewrite = false;
+
+    return true;
+}
+
+/*
+ * Records the solver's progress in the log at `path`. The first checkpoint to
+ * a path, and any once the log has grown a few times past a full snapshot,
+ * writes the whole state; the rest append what changed since the last one.
+ */
+bool wfc_checkpoint(Wfc *wfc, const char *path) {
+    Checkpoint *checkpoint = wfc->checkpoint;
+
+    if (checkpoint == NULL || strcmp(checkpoint->path, path) != 0) {
+        checkpoint_free(checkpoint);
+        wfc->checkpoint = checkpoint_create(wfc, path);
+        return checkpoint_rewrite(wfc);
+    }
+
+    if (checkpoint->rewrite || checkpoint->size > CHECKPOINT_COMPACT_RATIO * checkpoint->snapshot_size) {
+        return checkpoint_rewrite(wfc);
+    }
+
+    if (!checkpoint_record(wfc, checkpoint->file, false)) {
+        /* Replay stops at a broken record, so nothing after it would ever be read */
+        checkpoint->rewrite = true;
+        return false;
+    }
+    checkpoint_commit(wfc, checkpoint->file);
+
+    return true;
+}
+
+/* Applies one record whose checksum has been verified; false if it does not fit this solver */
+static bool checkpoint_apply(Wfc *wfc, const uint8_t *payload, uint64_t size) {
+    Grid *grid = wfc->grid;
+    int words = wfc->tile_set->num_words;
+    size_t domain_size = words * sizeof(uint64_t);
+
+    if (size < sizeof(RecordState)) {
+        return false;
+    }
+
+    const RecordState *state = (const RecordState *) payload;
+    uint64_t expected = sizeof(RecordState) + (uint64_t) state->num_cells * (sizeof(CellEntry) + domain_size)
+        + (uint64_t) (state->stack_size - state->stack_start) * (sizeof(StackNode) + domain_size);
+    if (size != expected || state->num_cells > (uint32_t) grid->num_cells || state->stack_start < 0
+            || state->stack_start > state->stack_size || state->stack_size > grid_size(grid)) {
+        return false;
+    }
+
+    const uint8_t *pos = payload + sizeof(RecordState);
+    for (uint32_t i = 0; i < state->num_cells; i++, pos += sizeof(CellEntry) + domain_size) {
+        const CellEntry *entry = (const CellEntry *) pos;
+        if (entry->idx >= (uint32_t) grid->num_cells) {
+            return false;
+        }
+
+        Cell *cell = &grid->cells[entry->idx];
+        memcpy(cell->options, pos + sizeof(CellEntry), domain_size);
+        cell->entropy = entry->entropy;
+        cell->collapsed = entry->flags & CELL_COLLAPSED;
+        cell->new = entry->flags & CELL_NEW;
+    }
+
+    for (int i = state->stack_start; i < state->stack_size; i++, pos += sizeof(StackNode) + domain_size) {
+        memcpy(&wfc->stack[i], pos, sizeof(StackNode));
+        memcpy(wfc->stack_domains + (size_t) i * words, pos + sizeof(StackNode), domain_size);
+    }
+
+    wfc->rng = state->rng;
+    wfc->heap_salt = state->heap_salt;
+    wfc->work = state->work;
+    wfc->tuner = state->tuner;
+    wfc->region = state->region;
+    wfc->heuristic = state->heuristic;
+    wfc->depth = state->depth;
+    wfc->visit_stamp = state->visit_stamp;
+    wfc->stack_size = state->stack_size;
+    wfc->conflict = state->conflict;
+    wfc->seeded = state->seeded;
+    wfc->failed = state->failed;
+
+    return true;
+}
+
+/*
+ * Replays the log at `path` into a solver created the same way as the one
+ * that wrote it, with the same tile set, size and constraints. Solving goes on
+ * exactly as it would have without the interruption, and later checkpoints to
+ * the same path append to the log.
+ */
+bool wfc_resume(Wfc *wfc, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(CheckpointHeader)) {
+        close(fd);
+        return false;
+    }
+
+    size_t length = st.st_size;
+    const uint8_t *map = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+
+    const CheckpointHeader *header = (const CheckpointHeader *) map;
+    Grid *grid = wfc->grid;
+    bool ok = memcmp(header->magic, "WFCK", 4) == 0 && header->version == CHECKPOINT_VERSION
+        && header->rows == (uint32_t) grid->rows && header->cols == (uint32_t) grid->cols
+        && header->layers == (uint32_t) grid->layers && header->num_tiles == (uint32_t) wfc->tile_set->num_tiles;
+
+    if (ok && header->block_shift != (uint32_t) grid->block_shift) {
+        wfc_set_layout(wfc, header->block_shift != 0 ? WFC_LAYOUT_BLOCKED : WFC_LAYOUT_ROWS);
+        grid = wfc->grid;
+    }
+    ok = ok && header->num_cells == (uint32_t) grid->num_cells;
+
+    /* Replay every record that made it to disk whole */
+    size_t end = sizeof(CheckpointHeader);
+    size_t snapshot_size = 0;
+    while (ok && length - end >= sizeof(RecordHeader)) {
+        const RecordHeader *record = (const RecordHeader *) (map + end);
+        const uint8_t *payload = map + end + sizeof(RecordHeader);
+        if (memcmp(record->magic, "WFCR", 4) != 0 || record->size > length - end - sizeof(RecordHeader)
+                || crc32(crc32(0, NULL, 0), payload, record->size) != record->crc
+                || !checkpoint_apply(wfc, payload, record->size)) {
+            break;
+        }
+
+        end += sizeof(RecordHeader) + record->size;
+        if (snapshot_size == 0) {
+            snapshot_size = end;
+        }
+    }
+    munmap((void *) map, length);
+
+    if (!ok || snapshot_size == 0) {
+        return false;
+    }
+
+    /* What the records leave out follows from what they hold */
+    for (int i = 0; i < grid->num_cells; i++) {
+        Cell *cell = &grid->cells[i];
+        cell->num_options = wfc->tile_set->kernels->count(wfc->tile_set, cell->options);
+        cell->heap_idx = -1;
+    }
+    heap_fill(wfc);
+    memset(wfc->visited, 0, grid->num_cells * sizeof(uint32_t));
+
+    /* Pick up the log where it was cut off */
+    checkpoint_free(wfc->checkpoint);
+    Checkpoint *checkpoint = wfc->checkpoint = checkpoint_create(wfc, path);
+    checkpoint->file = fopen(path, "r+b");
+    checkpoint->size = end;
+    checkpoint->snapshot_size = snapshot_size;
+    checkpoint->rewrite = checkpoint->file == NULL || ftruncate(fileno(checkpoint->file), end) != 0
+        || fseek(checkpoint->file, end, SEEK_SET) != 0;
+
+    for (int i = 0; i < grid->num_cells; i++) {
+        Cell *cell = &grid->cells[i];
+        checkpoint->flags[i] = cell_flags(cell);
+        checkpoint->entropy[i] = cell->entropy;
+    }
+    int words = wfc->tile_set->num_words;
+    memcpy(checkpoint->options, grid->option_pool, (size_t) grid->num_cells * words * sizeof(uint64_t));
+    memcpy(checkpoint->stack, wfc->stack, wfc->stack_size * sizeof(StackNode));
+    memcpy(checkpoint->stack_domains, wfc->stack_domains, (size_t) wfc->stack_size * words * sizeof(uint64_t));
+    checkpoint->stack_size = wfc->stack_size;
+
+    return true;
+}
+
+TileSet *wfc_tileset(Wfc *wfc) {
+    return wfc->tile_set;
+}
+
+int wfc_rows(Wfc *wfc) {
+    return wfc->grid->rows;
+}
+
+int wfc_depth(Wfc *wfc) {
+    /* A solve that ends mid-exploration reports the best setting measured, not the one on trial */
+    return wfc->tuner.active ? depth_ladder[wfc->tuner.best_rung] : wfc->depth;
+}
+
+bool wfc_parse_depth(const char *text, int *depth) {
+    if (strcmp(text, "full") == 0) {
+        *depth = WFC_DEPTH_FULL;
+        return true;
+    } else if (strcmp(text, "auto") == 0) {
+        *depth = WFC_DEPTH_AUTO;
+        return true;
+    }
+
+    char *end;
+    errno = 0;
+    long value = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || errno != 0 || value <= 0 || value > INT32_MAX) {
+        return false;
+    }
+
+    *depth = value;
+    return true;
+}
+
+int wfc_cols(Wfc *wfc) {
+    return wfc->grid->cols;
+}
+
+int wfc_layers(Wfc *wfc) {
+    return wfc->grid->layers;
+}
+
+int wfc_tile_at(Wfc *wfc, int r, int c) {
+    return wfc_voxel_at(wfc, r, c, 0);
+}
+
+int wfc_voxel_at(Wfc *wfc, int r, int c, int z) {
+    Cell *cell = &wfc->grid->cells[grid_index(wfc->grid, r, c, z)];
+
+    return cell->collapsed ? domain_first(cell->options, wfc->tile_set->num_words) : -1;
+}
+
+void wfc_draw(Wfc *wfc, Texture texture) {
+    Grid *grid = wfc->grid;
+    Tile **tiles = wfc->tile_set->tiles;
+    int num_tiles = wfc->tile_set->num_tiles;
+    int words = wfc->tile_set->num_words;
     int width = GetScreenWidth();
     int height = GetScreenHeight();
 
@@ -734,11 +2507,11 @@ void wfc_draw(Texture texture) {
 
     for (int i = 0; i < grid->rows; i++) {
         for (int j = 0; j < grid->cols; j++) {
-            Cell *cell = &grid->cells[i * grid->cols + j];
+            Cell *cell = &grid->cells[grid_index(grid, i, j, 0)];
 
             if (cell->collapsed && cell->new) {
                 cell->new = false;
-                Image img = cell->options[0]->img;
+                Image img = tiles[domain_first(cell->options, words)]->img;
                 Rectangle rect = {.x = img.width * j, .y = img.height * i, .width = img.width, .height = img.height};
 
                 UpdateTextureRec(texture, rect, img.data);
@@ -754,14 +2527,20 @@ void wfc_draw(Texture texture) {
                 ImageFormat(&combo, PIXELFORMAT_UNCOMPRESSED_R8G8B8);
 
                 float total_weight = 0.0;
-                for (int k = 0; k < cell->num_options; k++) {
-                    total_weight += cell->options[k]->frequency;
+                for (int k = 0; k < num_tiles; k++) {
+                    if (domain_has(cell->options, k)) {
+                        total_weight += tiles[k]->frequency;
+                    }
                 }
 
-                for (int k = 0; k < cell->num_options; k++) {
-                    Image src_img = cell->options[k]->img;
+                for (int k = 0; k < num_tiles; k++) {
+                    if (!domain_has(cell->options, k)) {
+                        continue;
+                    }
+
+                    Image src_img = tiles[k]->img;
                     uint8_t *src = (uint8_t *) src_img.data;
-                    float rel = cell->options[k]->frequency / total_weight;
+                    float rel = tiles[k]->frequency / total_weight;
                     for (int pixel_i = 0; pixel_i < img_height; pixel_i++) {
                         for (int pixel_j = 0; pixel_j < img_width; pixel_j++) {
                             for (int ch = 0; ch < 3; ch++) {
@@ -790,11 +2569,3 @@ void wfc_draw(Texture texture) {
 
     EndDrawing();
 }
-
-int wfc_tile_width() {
-    return tiles[0]->img.width;
-}
-
-int wfc_tile_height() {
-    return tiles[0]->img.height;
-}
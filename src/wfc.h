@@ -1,8 +1,86 @@
 #pragma once
+#include <stdbool.h>
 #include <raylib.h>
 
-void wfc_init(int seed, int rows, int cols, char *tile_set, int depth);
-void wfc_step();
-void wfc_draw(Texture texture);
-int wfc_tile_width();
-int wfc_tile_height();
+typedef struct TileSet TileSet;
+typedef struct Wfc Wfc;
+
+typedef enum {
+    WFC_RUNNING,
+    WFC_CONFLICT,
+    WFC_DONE,
+    WFC_FAILED
+} WfcStatus;
+
+/* How the next cell to collapse is picked */
+typedef enum {
+    WFC_MIN_ENTROPY,
+    WFC_SCANLINE,
+    WFC_RANDOM
+} WfcHeuristic;
+
+/* How cells are ordered in memory; blocked keeps vertical neighbors close on wide grids */
+typedef enum {
+    WFC_LAYOUT_ROWS,
+    WFC_LAYOUT_BLOCKED
+} WfcLayout;
+
+/* Tile sets are read-only once loaded and may be shared between solvers */
+TileSet *wfc_tileset_load(const char *dir_name);
+void wfc_tileset_free(TileSet *tile_set);
+int wfc_tileset_num_tiles(TileSet *tile_set);
+int wfc_tile_width(TileSet *tile_set);
+int wfc_tile_height(TileSet *tile_set);
+/* RGB888 pixels of a tile, wfc_tile_width x wfc_tile_height */
+const unsigned char *wfc_tile_pixels(TileSet *tile_set, int tile);
+
+/* Propagation depths besides a fixed radius: exact, or tuned while solving */
+#define WFC_DEPTH_FULL -1
+#define WFC_DEPTH_AUTO 0
+/* Reads "full", "auto" or a positive depth; false for anything else */
+bool wfc_parse_depth(const char *text, int *depth);
+
+Wfc *wfc_create(TileSet *tile_set, int seed, int rows, int cols, int depth);
+/* A stack of layers; tile sets loaded from sockets constrain the layers above and below */
+Wfc *wfc_create_3d(TileSet *tile_set, int seed, int rows, int cols, int layers, int depth);
+void wfc_free(Wfc *wfc);
+
+/*
+ * Constraints narrow the starting domain of cells and hold across restarts.
+ * They are propagated together, in one pass, when the next attempt starts.
+ * Each returns false if a cell is left without options or the area is invalid.
+ */
+/* Area constraints reach through every layer; wfc_fix_voxel pins a single cell */
+bool wfc_fix(Wfc *wfc, int r, int c, int tile);
+bool wfc_fix_voxel(Wfc *wfc, int r, int c, int z, int tile);
+bool wfc_restrict(Wfc *wfc, int r, int c, int rows, int cols, const int *tiles, int num_tiles);
+/* Restricts every cell whose pixel in a rows x cols mask is lit */
+bool wfc_restrict_mask(Wfc *wfc, Image mask, const int *tiles, int num_tiles);
+
+void wfc_set_heuristic(Wfc *wfc, WfcHeuristic heuristic);
+/* Keeps constraints but drops any progress; does nothing if the layout already matches */
+void wfc_set_layout(Wfc *wfc, WfcLayout layout);
+void wfc_restart(Wfc *wfc);
+WfcStatus wfc_step(Wfc *wfc);
+bool wfc_solve(Wfc *wfc, long max_steps);
+/* Races copies of the solver over the cores; the result only depends on the seed and the number of copies */
+bool wfc_solve_portfolio(Wfc *wfc, int num_instances, long max_steps);
+/* Re-rolls a rectangle of a finished map, widening it when it cannot be solved */
+bool wfc_regenerate(Wfc *wfc, int r, int c, int rows, int cols, long max_steps);
+/*
+ * Checkpoints append what changed since the last one to a log at `path`, and
+ * fsync it. Resuming needs a solver created the same way as the one that wrote
+ * the log, and continues exactly where it left off.
+ */
+bool wfc_checkpoint(Wfc *wfc, const char *path);
+bool wfc_resume(Wfc *wfc, const char *path);
+TileSet *wfc_tileset(Wfc *wfc);
+int wfc_rows(Wfc *wfc);
+int wfc_cols(Wfc *wfc);
+int wfc_layers(Wfc *wfc);
+/* The depth in use, WFC_DEPTH_FULL for exact; with WFC_DEPTH_AUTO, the best the tuner has measured */
+int wfc_depth(Wfc *wfc);
+/* The tile of a collapsed cell or -1; wfc_tile_at looks at the bottom layer */
+int wfc_tile_at(Wfc *wfc, int r, int c);
+int wfc_voxel_at(Wfc *wfc, int r, int c, int z);
+void wfc_draw(Wfc *wfc, Texture texture);